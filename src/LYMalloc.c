@@ -14,65 +14,756 @@
  * - A background thread that performs memory reclamation and balancing.
  * - Functions for memory allocation (`LYMalloc`), deallocation (`LYFree`), and initialization
  *   (`initMemoryAllocator`).
- * - Integration of OpenMP for handling multi-threading.
+ * - Heaps created on each thread's first allocation, sized to what the thread actually uses.
+ * - Global arenas grouped by NUMA node; threads refill from their own node first.
  *
  * Author: Xinyu Li
  * Last Modified: 04/17/2024
  */
+
+#define _GNU_SOURCE  // sched_getcpu
 #include "LYMalloc.h"
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <execinfo.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 pthread_t reclaim_thread;
 volatile int keep_running = 1;  // Flags that control the running of background threads
+static int reclaimThreadStarted;  // Otherwise threads run the decay pass themselves (reclaimInline)
+static uint64_t lastReclaimMs;
 
-static Heap globalHeap;
-static Heap localHeaps;
-#pragma omp threadprivate(localHeaps)
+// Decay purging: free arena pages idle for dirtyDecayMs are released to the kernel
+// (MADV_FREE first when muzzyDecayMs > 0, then MADV_DONTNEED). A negative time disables it.
+static long dirtyDecayMs = DIRTY_DECAY_MS;
+static long muzzyDecayMs = MUZZY_DECAY_MS;
 
+// The global tier is sharded into per-CPU arenas, each with its own lock
+static Arena globalArenas[MAX_ARENAS] = {
+    [0 ... MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static int arenaCount;
 
-#include "LYMalloc.h"
+// NUMA topology: each CPU maps to a node, and each node owns a contiguous range of arenas,
+// see layoutArenas()
+static int numaNodes = 1;
+static int numaSimulated;  // Set by LYSetNumaTopology(); simulated nodes are not bound
+static unsigned char cpuNode[MAX_CPUS];
+static unsigned short cpuSlot[MAX_CPUS];  // Position of the CPU among its node's CPUs
+static int nodeCpus[MAX_NUMA_NODES];
+static int nodeFirstArena[MAX_NUMA_NODES];
+static int nodeArenas[MAX_NUMA_NODES];
+static unsigned char arenaNode[MAX_ARENAS];
+static int nodeIds[MAX_NUMA_NODES];  // Kernel number of each node
+static _Thread_local int threadNode = -1;  // LYSetThreadNode(), -1 follows the CPU
+static pthread_mutex_t heapListLock = PTHREAD_MUTEX_INITIALIZER;  // Guards the heap registry
 
-pthread_t reclaim_thread;
-volatile int keep_running = 1;  // Flags that control the running of background threads
+// Each thread owns its heap outright, so the hot path takes no lock and no atomic.
+// Heaps are created on a thread's first allocation and kept on a registry for teardown.
+// Initial-exec TLS keeps the access a plain %fs load even inside liblymalloc.so, where the
+// default model would call __tls_get_addr, which may itself allocate.
+// Not static: LYMallocSmall() in LYMalloc.h pops from it inline, so liblymalloc.so exports
+// it along with the rest of the LY* API.
+_Thread_local Heap* LYLocalHeap __attribute__((tls_model("initial-exec")));
+static Heap* allHeaps;
+static Heap* orphanHeaps;  // Heaps of exited threads, adopted by the next new thread
+static pthread_key_t heapKey;  // Its destructor runs releaseLocalHeap() at thread exit
+static pthread_once_t heapKeyOnce = PTHREAD_ONCE_INIT;
+static int heapKeyReady;
+
+// Allocator metadata (heaps and block descriptors) is carved from its own mappings, never
+// from libc, so the allocator can stand in for malloc itself (see LYPreload.c)
+static char* metaCursor;
+static size_t metaLeft;
+static MemoryBlock* metaSpareBlocks;  // Descriptors released by freeMemoryAllocator()
+static pthread_mutex_t metaLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Chunks mapped for the heaps and arenas, unmapped by freeMemoryAllocator(). Guarded by metaLock.
+typedef struct SystemChunk {
+    struct SystemChunk* next;
+    void* start;
+    size_t length;
+} SystemChunk;
+static SystemChunk* systemChunks;
+static SystemChunk* spareChunks;  // Records of unmapped chunks, reused by the next cycle
+
+// Process-wide counters for LYMallocStats(), updated atomically off the hot path
+static size_t heapMappedBytes;
+static size_t metaMappedBytes;
+static uint64_t purgePasses;
+static uint64_t purgedBytes;
+
+// Heap profiler: on average one allocation per profileRate bytes is sampled. Samples are
+// aggregated per distinct stack into buckets that live as long as the process.
+typedef struct ProfileBucket {
+    struct ProfileBucket* next;
+    uint64_t hash;
+    int depth;
+    void* stack[PROFILE_MAX_DEPTH];
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t allocBytes;
+    uint64_t freeBytes;
+} ProfileBucket;
+
+static size_t profileRate;  // 0 disables sampling
+static int profileSampled;  // Set by the first sample; LYFreeSized() then has to look blocks up
+static ProfileBucket* profileBuckets[PROFILE_BUCKETS];
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;  // Guards bucket creation and counters
+
+// Large-object tier: every request of at least mmapThreshold bytes is its own mapping.
+// largeHeap.usedHead lists the live mappings; freed ones are unmapped or parked in mmapCache.
+static size_t mmapThreshold = MMAP_THRESHOLD;
+static int hugePages;  // LYSetHugePages(): 2 MB-aligned segments backed by transparent huge pages
+static Heap largeHeap;
+static MemoryBlock* mmapCache[MMAP_CACHE_SLOTS];
+static size_t mmapCacheBytes;
+static int mmapCacheNext;  // Oldest slot, evicted first
+static uint64_t largeAllocs, largeFrees, largeCacheHits;
+static size_t largeLiveBytes;
+static pthread_mutex_t largeLock = PTHREAD_MUTEX_INITIALIZER;  // Guards largeHeap and mmapCache
+
+// Three-level radix tree from page number to the MemoryBlock that owns the page.
+// Interior nodes are created on demand and never removed, so readers need no lock.
+typedef struct {
+    MemoryBlock* blocks[1 << PAGEMAP_BITS];
+} PageMapLeaf;
+
+typedef struct {
+    PageMapLeaf* leaves[1 << PAGEMAP_BITS];
+} PageMapNode;
+
+static PageMapNode* pageMap[1 << PAGEMAP_BITS];
+static pthread_mutex_t pageMapLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Object size of each class, indexed by sizeToClass()
+static const size_t classSizes[NUM_SIZE_CLASSES] = {
+    0,
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+    5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384,
+    20480, 24576, 28672, 32768
+};
+
+size_t classToSize(int sizeClass) {
+    return classSizes[sizeClass];
+}
+
+// Ask the kernel to back a range with transparent huge pages
+static void adviseHugePages(void* start, size_t length) {
+#ifdef MADV_HUGEPAGE
+    madvise(start, length, MADV_HUGEPAGE);
+#else
+    (void)start;
+    (void)length;
+#endif
+}
+
+// Page-aligned, zero-filled memory from the system, so every block can be found through the
+// page map and purged with madvise. In huge page mode anything of at least HUGE_PAGE_SIZE is
+// a 2 MB-aligned segment, so the runs and blocks carved from it share few TLB entries.
+static void* systemAlloc(size_t length) {
+    if (!__atomic_load_n(&hugePages, __ATOMIC_RELAXED) || length < HUGE_PAGE_SIZE) {
+        void* memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return memory == MAP_FAILED ? NULL : memory;
+    }
+
+    size_t mapLength = length + HUGE_PAGE_SIZE - PAGE_SIZE;
+    char* memory = mmap(NULL, mapLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    char* aligned = (char*)(((uintptr_t)memory + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > memory) {
+        munmap(memory, aligned - memory);
+    }
+    if (memory + mapLength > aligned + length) {
+        munmap(aligned + length, memory + mapLength - (aligned + length));
+    }
+    adviseHugePages(aligned, length);
+    return aligned;
+}
+
+void LYSetHugePages(int enable) {
+    __atomic_store_n(&hugePages, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+static uint64_t nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Zeroed, never freed; callers keep their own free lists
+static void* metaAlloc(size_t size, size_t alignment) {
+    pthread_mutex_lock(&metaLock);
+    size_t pad = (alignment - ((uintptr_t)metaCursor & (alignment - 1))) & (alignment - 1);
+    if (metaLeft < pad + size) {
+        size_t chunk = size > META_CHUNK_SIZE ? (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1) : META_CHUNK_SIZE;
+        char* memory = (char*)systemAlloc(chunk);
+        if (!memory) {
+            pthread_mutex_unlock(&metaLock);
+            return NULL;
+        }
+        metaCursor = memory;
+        metaLeft = chunk;
+        __atomic_fetch_add(&metaMappedBytes, chunk, __ATOMIC_RELAXED);
+        pad = 0;
+    }
+    void* ptr = metaCursor + pad;
+    metaCursor += pad + size;
+    metaLeft -= pad + size;
+    pthread_mutex_unlock(&metaLock);
+    return ptr;
+}
+
+// Remember a heap chunk for teardown; fails only if no record can be allocated
+static int recordChunk(void* start, size_t length) {
+    pthread_mutex_lock(&metaLock);
+    SystemChunk* chunk = spareChunks;
+    if (chunk) {
+        spareChunks = chunk->next;
+    }
+    pthread_mutex_unlock(&metaLock);
+    if (!chunk) {
+        chunk = (SystemChunk*)metaAlloc(sizeof(SystemChunk), sizeof(void*));
+        if (!chunk) {
+            return -1;
+        }
+    }
+
+    chunk->start = start;
+    chunk->length = length;
+    pthread_mutex_lock(&metaLock);
+    chunk->next = systemChunks;
+    systemChunks = chunk;
+    pthread_mutex_unlock(&metaLock);
+    return 0;
+}
+
+static void* pageMapNodeAlloc(size_t size) {
+    void* node = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (node == MAP_FAILED) {
+        return NULL;
+    }
+    __atomic_fetch_add(&metaMappedBytes, size, __ATOMIC_RELAXED);
+    return node;
+}
+
+MemoryBlock* pageMapGet(const void* addr) {
+    uintptr_t page = (uintptr_t)addr >> PAGE_SHIFT;
+    if (page >> (3 * PAGEMAP_BITS)) {
+        return NULL;
+    }
+
+    PageMapNode* node = __atomic_load_n(&pageMap[page >> (2 * PAGEMAP_BITS)], __ATOMIC_ACQUIRE);
+    if (!node) {
+        return NULL;
+    }
+    PageMapLeaf* leaf = __atomic_load_n(&node->leaves[(page >> PAGEMAP_BITS) & PAGEMAP_MASK], __ATOMIC_ACQUIRE);
+    if (!leaf) {
+        return NULL;
+    }
+    return __atomic_load_n(&leaf->blocks[page & PAGEMAP_MASK], __ATOMIC_ACQUIRE);
+}
+
+static int pageMapSet(uintptr_t page, MemoryBlock* block) {
+    size_t i1 = page >> (2 * PAGEMAP_BITS);
+    size_t i2 = (page >> PAGEMAP_BITS) & PAGEMAP_MASK;
+
+    PageMapNode* node = __atomic_load_n(&pageMap[i1], __ATOMIC_ACQUIRE);
+    PageMapLeaf* leaf = node ? __atomic_load_n(&node->leaves[i2], __ATOMIC_ACQUIRE) : NULL;
+    if (!leaf) {
+        // Slow path: grow the tree under the lock
+        pthread_mutex_lock(&pageMapLock);
+        if (!pageMap[i1]) {
+            __atomic_store_n(&pageMap[i1], (PageMapNode*)pageMapNodeAlloc(sizeof(PageMapNode)), __ATOMIC_RELEASE);
+        }
+        node = pageMap[i1];
+        if (node && !node->leaves[i2]) {
+            __atomic_store_n(&node->leaves[i2], (PageMapLeaf*)pageMapNodeAlloc(sizeof(PageMapLeaf)), __ATOMIC_RELEASE);
+        }
+        leaf = node ? node->leaves[i2] : NULL;
+        pthread_mutex_unlock(&pageMapLock);
+        if (!leaf) {
+            return -1;
+        }
+    }
+
+    __atomic_store_n(&leaf->blocks[page & PAGEMAP_MASK], block, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Runs map every page so interior objects resolve. Other blocks map their first and last
+// page, which double as the boundary tags that coalescing reads.
+static int pageMapRegister(MemoryBlock* block) {
+    uintptr_t page = (uintptr_t)block->start >> PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t)block->start + block->length - 1) >> PAGE_SHIFT;
+
+    if (!block->sizeClass) {
+        if (pageMapSet(page, block) != 0 || pageMapSet(last, block) != 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    for (; page <= last; page++) {
+        if (pageMapSet(page, block) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-static Heap globalHeap;
-static Heap localHeaps;
-#pragma omp threadprivate(localHeaps)
+static void pageMapUnregister(MemoryBlock* block) {
+    pageMapSet((uintptr_t)block->start >> PAGE_SHIFT, NULL);
+    pageMapSet(((uintptr_t)block->start + block->length - 1) >> PAGE_SHIFT, NULL);
+}
+
+// Forget every mapping, used at teardown once all descriptors are gone
+static void pageMapClear(void) {
+    pthread_mutex_lock(&pageMapLock);
+    for (size_t i = 0; i < (1 << PAGEMAP_BITS); i++) {
+        PageMapNode* node = pageMap[i];
+        for (size_t j = 0; node && j < (1 << PAGEMAP_BITS); j++) {
+            if (node->leaves[j]) {
+                memset(node->leaves[j], 0, sizeof(PageMapLeaf));
+            }
+        }
+    }
+    pthread_mutex_unlock(&pageMapLock);
+}
+
+// Descriptors are recycled through a per-heap spare list and never unmapped while the
+// allocator runs, so a stale page map entry always points at a valid MemoryBlock.
+// Descriptors move between a heap and the shared pool a slab (about a page) at a time, so
+// metaLock is taken once per slab, a heap's descriptors sit together, and blocks that
+// coalesce in one heap after being split in another do not strand descriptors.
+#define BLOCK_SLAB (PAGE_SIZE / sizeof(MemoryBlock))
+
+static MemoryBlock* newBlock(Heap* heap) {
+    if (!heap->spareBlocks) {
+        pthread_mutex_lock(&metaLock);
+        while (metaSpareBlocks && heap->spareCount < BLOCK_SLAB) {
+            MemoryBlock* spare = metaSpareBlocks;
+            metaSpareBlocks = spare->next;
+            spare->next = heap->spareBlocks;
+            heap->spareBlocks = spare;
+            heap->spareCount++;
+        }
+        pthread_mutex_unlock(&metaLock);
+    }
+    if (!heap->spareBlocks) {
+        MemoryBlock* slab = (MemoryBlock*)metaAlloc(BLOCK_SLAB * sizeof(MemoryBlock), CACHE_LINE_SIZE);
+        if (!slab) {
+            return NULL;
+        }
+        for (size_t i = BLOCK_SLAB; i > 0; i--) {
+            slab[i - 1].next = heap->spareBlocks;
+            heap->spareBlocks = &slab[i - 1];
+        }
+        heap->spareCount = BLOCK_SLAB;
+    }
+    MemoryBlock* block = heap->spareBlocks;
+    heap->spareBlocks = block->next;
+    heap->spareCount--;
+
+    block->start = NULL;
+    block->length = 0;
+    block->next = NULL;
+    block->prev = NULL;
+    block->owner = NULL;
+    __atomic_store_n(&block->freeHeap, NULL, __ATOMIC_RELAXED);
+    block->sizeClass = 0;
+    block->mapped = 0;
+    block->pageState = PAGES_DIRTY;
+    block->freeSince = 0;
+    block->sample = NULL;
+    block->sampleSize = 0;
+    return block;
+}
+
+static void dropBlock(Heap* heap, MemoryBlock* block) {
+    __atomic_store_n(&block->freeHeap, NULL, __ATOMIC_RELAXED);
+    block->owner = NULL;
+    block->next = heap->spareBlocks;
+    heap->spareBlocks = block;
+    if (++heap->spareCount < 2 * BLOCK_SLAB) {
+        return;
+    }
+
+    // Keep one slab's worth, the rest goes back to the shared pool
+    MemoryBlock* last = heap->spareBlocks;
+    for (size_t i = 1; i < BLOCK_SLAB; i++) {
+        last = last->next;
+    }
+    MemoryBlock* surplus = last->next;
+    last->next = NULL;
+    heap->spareCount = BLOCK_SLAB;
+    for (last = surplus; last->next; last = last->next) {
+    }
+    pthread_mutex_lock(&metaLock);
+    last->next = metaSpareBlocks;
+    metaSpareBlocks = surplus;
+    pthread_mutex_unlock(&metaLock);
+}
+
+static void detachFree(Heap* heap, MemoryBlock* block) {
+    __atomic_store_n(&block->freeHeap, NULL, __ATOMIC_RELAXED);
+    removeFromHeap(&heap->freeHead, block);
+    heap->freeBytes -= block->length;
+}
+
+// A merged block is as dirty as its dirtiest part and decays from its most recent free
+static void mergePageState(MemoryBlock* into, const MemoryBlock* from) {
+    if (into->pageState == PAGES_PARTIAL || from->pageState == PAGES_PARTIAL) {
+        into->pageState = PAGES_DIRTY;  // The merged block's interior takes in dirty edges
+    }
+    else if (from->pageState > into->pageState) {
+        into->pageState = from->pageState;
+    }
+    if (from->freeSince > into->freeSince) {
+        into->freeSince = from->freeSince;
+    }
+}
+
+// Put a block on the heap's free list, first merging it with free neighbours of the same heap.
+// The page map entries just outside the block act as boundary tags. Only the thread (or lock
+// holder) of a heap ever sets freeHeap to that heap, so the check below cannot race.
+static void insertFree(Heap* heap, MemoryBlock* block) {
+    char* start = (char*)block->start;
+    char* end = start + block->length;
+
+    MemoryBlock* left = pageMapGet(start - PAGE_SIZE);
+    if (left && left != block && __atomic_load_n(&left->freeHeap, __ATOMIC_RELAXED) == heap &&
+        (char*)left->start + left->length == start) {
+        detachFree(heap, left);
+        left->length += block->length;
+        mergePageState(left, block);
+        dropBlock(heap, block);
+        block = left;
+    }
+
+    MemoryBlock* right = pageMapGet(end);
+    if (right && right != block && __atomic_load_n(&right->freeHeap, __ATOMIC_RELAXED) == heap &&
+        (char*)right->start == end) {
+        detachFree(heap, right);
+        block->length += right->length;
+        mergePageState(block, right);
+        dropBlock(heap, right);
+    }
+
+    block->owner = NULL;
+    block->sizeClass = 0;
+    pageMapRegister(block);
+
+    // Add the block to the free list, keeping it sorted
+    addToHeap(&heap->freeHead, block);
+    heap->freeBytes += block->length;
+    __atomic_store_n(&block->freeHeap, heap, __ATOMIC_RELAXED);
+}
 
 void initHeap(Heap* heap, void* start, size_t length) {
-    MemoryBlock* block = (MemoryBlock*)malloc(sizeof(MemoryBlock));
+    MemoryBlock* block = newBlock(heap);
+    if (!block) {
+        return;
+    }
     block->start = start;
     block->length = length;
-    block->next = heap->freeHead;
-    heap->freeHead = block;
+    block->pageState = PAGES_CLEAN;  // Heaps are seeded straight from systemAlloc
+    insertFree(heap, block);
+}
+
+void LYSetDecayTime(long dirtyMs, long muzzyMs) {
+    __atomic_store_n(&dirtyDecayMs, dirtyMs, __ATOMIC_RELAXED);
+    __atomic_store_n(&muzzyDecayMs, muzzyMs, __ATOMIC_RELAXED);
+}
 
-    heap->usedHead = NULL;
+// A few decay passes per decay period, so pages are released close to their deadline
+static long decayStepMs(void) {
+    long period = __atomic_load_n(&dirtyDecayMs, __ATOMIC_RELAXED) / DECAY_STEPS;
+    return period < 10 ? 10 : period > 1000 ? 1000 : period;
 }
 
 void* reclaimRoutine(void* arg) {
     while (keep_running) {
-        sleep(1);  // Performs a memory recall every 5 seconds
-        reclaimMemory(omp_get_max_threads());
+        usleep(decayStepMs() * 1000);
+        reclaimMemory();
     }
     return NULL;
 }
 
-void initMemoryAllocator(int threadCount) {
-    // allocate globalHeap
-    char* globalMemory = (char*)malloc(HEAP_SIZE * threadCount);
-    initHeap(&globalHeap, globalMemory, HEAP_SIZE * threadCount);
+// Without the background thread (liblymalloc.so never starts one) the threads that hand
+// memory back run the decay pass, at most one of them per decay step
+static void reclaimInline(void) {
+    if (__atomic_load_n(&reclaimThreadStarted, __ATOMIC_RELAXED)) {
+        return;
+    }
+    uint64_t now = nowMs();
+    uint64_t last = __atomic_load_n(&lastReclaimMs, __ATOMIC_RELAXED);
+    if (now - last < (uint64_t)decayStepMs() ||
+        !__atomic_compare_exchange_n(&lastReclaimMs, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    reclaimMemory();
+}
+
+// Next range of a list such as "0-3,8-11", the format of cpulist and node/online.
+// Returns the position after it, or NULL at the end of the list.
+static const char* nextRange(const char* list, int* first, int* last) {
+    while (*list == ',' || *list == ' ') {
+        list++;
+    }
+    if (*list < '0' || *list > '9') {
+        return NULL;
+    }
+    char* end;
+    *first = (int)strtol(list, &end, 10);
+    *last = *first;
+    if (*end == '-') {
+        *last = (int)strtol(end + 1, &end, 10);
+    }
+    return end;
+}
+
+// Put the CPUs in list on node and return the highest, -1 if none
+static int assignCpus(const char* list, int node) {
+    int first, last, highest = -1;
+    while ((list = nextRange(list, &first, &last)) != NULL) {
+        for (int cpu = first; cpu <= last && cpu < MAX_CPUS; cpu++) {
+            cpuNode[cpu] = (unsigned char)node;
+            cpuSlot[cpu] = (unsigned short)nodeCpus[node]++;
+        }
+        highest = last > highest ? last : highest;
+    }
+    return highest;
+}
+
+static void resetTopology(void) {
+    memset(cpuNode, 0, sizeof(cpuNode));
+    memset(cpuSlot, 0, sizeof(cpuSlot));
+    memset(nodeCpus, 0, sizeof(nodeCpus));
+    numaNodes = 1;
+}
+
+// Split count arenas over the nodes in proportion to their CPUs, at least one each, and
+// give every node a contiguous range. Returns the number of arenas laid out.
+static int layoutArenas(int count) {
+    int total = 0;
+    for (int node = 0; node < numaNodes; node++) {
+        total += nodeCpus[node];
+    }
+    if (numaNodes < 2 || total == 0) {
+        nodeFirstArena[0] = 0;
+        nodeArenas[0] = count;
+        memset(arenaNode, 0, sizeof(arenaNode));
+        return count;
+    }
+
+    int used = 0;
+    for (int node = 0; node < numaNodes; node++) {
+        int share = (int)((int64_t)count * nodeCpus[node] / total);
+        nodeArenas[node] = share > 0 ? share : 1;
+        used += nodeArenas[node];
+    }
+    while (used > MAX_ARENAS) {
+        int largest = 0;
+        for (int node = 1; node < numaNodes; node++) {
+            largest = nodeArenas[node] > nodeArenas[largest] ? node : largest;
+        }
+        nodeArenas[largest]--;
+        used--;
+    }
+
+    int arena = 0;
+    for (int node = 0; node < numaNodes; node++) {
+        nodeFirstArena[node] = arena;
+        for (int i = 0; i < nodeArenas[node]; i++) {
+            arenaNode[arena++] = (unsigned char)node;
+        }
+    }
+    // Arenas of an earlier, larger layout are nobody's home but keep their free pages
+    memset(arenaNode + used, 0, MAX_ARENAS - used);
+    return used;
+}
+
+// Read the nodes in /sys/devices/system/node with plain syscalls, since this runs inside
+// the first allocation. Without the directory there is one node.
+static void discoverNodes(void) {
+    char buf[1024];
+    resetTopology();
+    numaSimulated = 0;
+
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return;
+    }
+    buf[n] = '\0';
+
+    int ids[MAX_NUMA_NODES];
+    int count = 0;
+    int first, last;
+    for (const char* list = buf; (list = nextRange(list, &first, &last)) != NULL; ) {
+        for (int id = first; id <= last && count < MAX_NUMA_NODES; id++) {
+            if (id < MAX_NUMA_NODES) {  // mbind() masks hold MAX_NUMA_NODES bits
+                ids[count++] = id;
+            }
+        }
+    }
+
+    int nodes = 0;
+    for (int i = 0; i < count; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0) {
+            continue;
+        }
+        buf[n] = '\0';
+        if (assignCpus(buf, nodes) >= 0) {  // Memory-only nodes get no arena
+            nodeIds[nodes++] = ids[i];
+        }
+    }
+    numaNodes = nodes > 0 ? nodes : 1;
+}
+
+static int systemArenaCount(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    return cpus < 1 ? 1 : cpus > MAX_ARENAS ? MAX_ARENAS : (int)cpus;
+}
+
+static int getArenaCount(void) {
+    int count = __atomic_load_n(&arenaCount, __ATOMIC_RELAXED);
+    if (__builtin_expect(count == 0, 0)) {
+        // sysconf may allocate; a nested call settles for arena 0 instead of recursing
+        __atomic_store_n(&arenaCount, 1, __ATOMIC_RELAXED);
+        discoverNodes();
+        count = layoutArenas(systemArenaCount());
+        __atomic_store_n(&arenaCount, count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+// Replace the topology with simulated nodes, e.g. "0-3;4-7" for two nodes of four CPUs,
+// so the node selection can be exercised on a single-node machine. NULL goes back to
+// /sys/devices/system/node. Call it before other threads allocate. The listed CPUs get one
+// arena each (up to MAX_ARENAS), split by node. The arena count never shrinks, since free
+// pages stay on their arenas; arenas past the layout are simply nobody's home.
+void LYSetNumaTopology(const char* nodes) {
+    int count = getArenaCount();
+    int want;
+    if (!nodes) {
+        discoverNodes();
+        want = systemArenaCount();
+    }
+    else {
+        resetTopology();
+        int node = 0, highest = -1;
+        const char* spec = nodes;
+        while (node < MAX_NUMA_NODES) {
+            int last = assignCpus(spec, node);
+            highest = last > highest ? last : highest;
+            nodeIds[node] = node;
+            node++;
+            spec = strchr(spec, ';');
+            if (!spec) {
+                break;
+            }
+            spec++;
+        }
+        numaNodes = node;
+        numaSimulated = 1;
+        want = highest < 0 ? 1 : highest < MAX_ARENAS ? highest + 1 : MAX_ARENAS;
+    }
+
+    // A simulated layout must not depend on how many CPUs the machine has
+    int used = layoutArenas(nodes || want > count ? want : count);
+    if (used > count) {
+        __atomic_store_n(&arenaCount, used, __ATOMIC_RELAXED);
+    }
+}
+
+// Tie the calling thread's refills and spills to a node, e.g. after pinning it there;
+// -1 follows the CPU the thread runs on again
+void LYSetThreadNode(int node) {
+    getArenaCount();  // The topology is read on first use
+    threadNode = node >= 0 && node < numaNodes ? node : -1;
+}
 
-    #pragma omp parallel num_threads(threadCount)
-    {
-        char* localMemory = (char*)malloc(HEAP_SIZE);
-        initHeap(&localHeaps, localMemory, HEAP_SIZE);
+// Arena for the CPU the thread runs on, or a hash of the thread id if that is unknown.
+// The CPU picks the node (unless LYSetThreadNode() did), then an arena of that node.
+static int homeArena(void) {
+    int count = getArenaCount();
+    int cpu = sched_getcpu();
+    int known = cpu >= 0 && cpu < MAX_CPUS;
+    if (cpu < 0) {
+        uint64_t id = (uint64_t)(uintptr_t)pthread_self();
+        cpu = (int)(((id >> 12) * 0x9E3779B97F4A7C15ULL) >> 40);
     }
+    if (numaNodes < 2) {
+        return cpu % count;
+    }
+
+    int node = threadNode >= 0 ? threadNode : known ? cpuNode[cpu] : 0;
+    int slot = known ? cpuSlot[cpu] : cpu;
+    return nodeFirstArena[node] + slot % nodeArenas[node];
+}
+
+// Prefer the node of the arena a fresh chunk is carved for. First touch alone would leave
+// the pieces spilled back to the arena wherever the thread that later touches them runs.
+static void bindToNode(void* start, size_t length, int node) {
+#ifdef SYS_mbind
+    if (numaNodes < 2 || numaSimulated) {
+        return;
+    }
+    unsigned long mask = 1UL << nodeIds[node];
+    syscall(SYS_mbind, start, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);  // Best effort
+#else
+    (void)start;
+    (void)length;
+    (void)node;
+#endif
+}
+
+// Nothing is mapped up front: every thread gets its heap on its first allocation and the
+// arenas fill up as the threads grow and spill, so threadCount is only a hint
+void initMemoryAllocator(int threadCount) {
+    (void)threadCount;
 
-    pthread_create(&reclaim_thread, NULL, reclaimRoutine, NULL);
+    keep_running = 1;
+    if (pthread_create(&reclaim_thread, NULL, reclaimRoutine, NULL) == 0) {
+        __atomic_store_n(&reclaimThreadStarted, 1, __ATOMIC_RELAXED);
+    }
 }
 
 void addToHeap(MemoryBlock** head, MemoryBlock* newBlock) {
     if (*head == NULL || (*head)->length < newBlock->length) {
+        newBlock->prev = NULL;
         newBlock->next = *head;
+        if (*head) {
+            (*head)->prev = newBlock;
+        }
         *head = newBlock;
     }
     else {
@@ -87,54 +778,59 @@ void addToHeap(MemoryBlock** head, MemoryBlock* newBlock) {
 
         // insert
         newBlock->next = current;
+        newBlock->prev = prev;
+        if (current) {
+            current->prev = newBlock;
+        }
         if (prev) {
             prev->next = newBlock;
         }
     }
 }
 
-
-MemoryBlock* findAndDetachBlock(Heap* heap, size_t len) {
-    MemoryBlock *prev = NULL, *current = heap->freeHead;
-    MemoryBlock *best_fit_prev = NULL, *best_fit = NULL;
-
-    // traverse to find the fittest block
-    while (current != NULL) {
-        if (current->length >= len &&
-            (current->next == NULL || current->next->length < len)) {
-            best_fit_prev = prev;
-            best_fit = current;
-            break;
-        }
-        prev = current;
-        current = current->next;
+void removeFromHeap(MemoryBlock** head, MemoryBlock* block) {
+    if (block->prev) {
+        block->prev->next = block->next;
+    }
+    else {
+        *head = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
     }
+    block->next = NULL;
+    block->prev = NULL;
+}
 
-    if (best_fit != NULL) {
-        // remove from free list
-        if (best_fit_prev) {
-            best_fit_prev->next = best_fit->next;
-        }
-        else {
-            heap->freeHead = best_fit->next;  // only one element in free list, update head
-        }
+// Used blocks need no order, so they are pushed at the front in O(1)
+static void pushBlock(MemoryBlock** head, MemoryBlock* block) {
+    block->prev = NULL;
+    block->next = *head;
+    if (*head) {
+        (*head)->prev = block;
+    }
+    *head = block;
+}
 
-        if (best_fit->length - len >= SIZE) {
-            MemoryBlock* newBlock = (MemoryBlock*)malloc(sizeof(MemoryBlock));
-            newBlock->start = best_fit->start;
-            newBlock->length = len;
-            addToHeap(&heap->usedHead, newBlock);
+MemoryBlock* findAndDetachBlock(Heap* heap, size_t len) {
+    MemoryBlock* best_fit = findBlock(heap, len);
 
+    if (best_fit != NULL) {
+        MemoryBlock* front;
+        if (best_fit->length - len >= SIZE && (front = newBlock(heap)) != NULL) {
+            front->start = best_fit->start;
+            front->length = len;
+            front->pageState = best_fit->pageState;
+            pushBlock(&heap->usedHead, front);
 
             best_fit->start += len;
             best_fit->length -= len;
-            addToHeap(&heap->freeHead, best_fit);  // Rejoin freeHead
+            insertFree(heap, best_fit);  // Rejoin freeHead
 
-            return newBlock;
-            
+            return front;
         }
 
-        best_fit->next = NULL;
+        pushBlock(&heap->usedHead, best_fit);
         return best_fit;
     }
 
@@ -142,239 +838,1847 @@ MemoryBlock* findAndDetachBlock(Heap* heap, size_t len) {
 }
 
 MemoryBlock* findBlock(Heap* heap, size_t len) {
-    MemoryBlock *prev = NULL, *current = heap->freeHead;
-    MemoryBlock *best_fit_prev = NULL, *best_fit = NULL;
+    MemoryBlock *current = heap->freeHead;
+    MemoryBlock *best_fit = NULL;
 
     // traverse to find the fittest block
     while (current != NULL) {
         if (current->length >= len &&
             (current->next == NULL || current->next->length < len)) {
-            best_fit_prev = prev;
             best_fit = current;
             break;
         }
-        prev = current;
         current = current->next;
     }
 
     if (best_fit != NULL) {
-        // remove from free list
-        if (best_fit_prev) {
-            best_fit_prev->next = best_fit->next;
-        }
-        else {
-            heap->freeHead = best_fit->next;  // only one element in free list, update head
-        }
-
-        best_fit->next = NULL;
-        return best_fit;
+        detachFree(heap, best_fit);
     }
 
-    return NULL;
+    return best_fit;
 }
 
-
-void* LYMalloc(size_t size) {
-    size_t len = (size + 63) & ~63;
+static MemoryBlock* takeFromArena(Arena* arena, size_t len, size_t want) {
     MemoryBlock* block = NULL;
+    Heap* global = &arena->heap;
 
-    // Try to allocate from local heap first
-    #pragma omp critical(localHeaps)
-    {
-        if (localHeaps.freeHead && localHeaps.freeHead->length >= len) {
-            // find the best fit block
-            block = findAndDetachBlock(&localHeaps, len);
-        }
-    }
-
-    // If not enough memory in local heap, try global heap
-    if (!block) {
-        #pragma omp critical(globalHeap)
-        {
-            if (globalHeap.freeHead && globalHeap.freeHead->length >= len) {
-                block = findBlock(&globalHeap, len);
-                if (block) {
-                    if (block->length - len >= GSIZE ) {
-                        size_t remaining_length = block->length - len;
-                        void* remaining_start = (char*)block->start + len;
-
-                        MemoryBlock* newBlock = (MemoryBlock*)malloc(sizeof(MemoryBlock));
-                        newBlock->start = remaining_start;
-                        newBlock->length = remaining_length;
-                        addToHeap(&globalHeap.freeHead, newBlock);
-                        
-                        addToHeap(&localHeaps.freeHead, block);  // Rejoin freeHead            
-                    }
-                }
-            }
-        }
-    }
-
-    // If still no block found, allocate directly from system
-    if (!block) {
-        block = (MemoryBlock*)malloc(sizeof(MemoryBlock) + len);
-        if (block) {
-            block->start = (void*)((char*)block + sizeof(MemoryBlock));
-            block->length = len;
-            block->next = NULL;
+    pthread_mutex_lock(&arena->lock);
+    if (global->freeHead && global->freeHead->length >= len) {
+        block = findBlock(global, global->freeHead->length >= want ? want : len);
+        MemoryBlock* rest;
+        if (block && block->length > want && block->length - want >= GSIZE &&
+            (rest = newBlock(global)) != NULL) {
+            // Give back what the caller does not need
+            rest->start = (char*)block->start + want;
+            rest->length = block->length - want;
+            rest->pageState = block->pageState;
+            rest->freeSince = block->freeSince;
+            block->length = want;
+            insertFree(global, rest);
         }
     }
+    pthread_mutex_unlock(&arena->lock);
 
-    return block ? block->start : NULL;
+    return block;
 }
 
-void LYFree(void* ptr) {
-    if (ptr == NULL)
-        return;
-
-    // Lock the local heaps as we're going to modify them
-    #pragma omp critical(localHeaps)
-    {
-        MemoryBlock *current = localHeaps.usedHead;
-        MemoryBlock *prev = NULL;
-
-        // Traverse the used list to find the block that matches the pointer
-        while (current != NULL) {
-            if ((char*)current->start == (char*)ptr) {
-                // Found the block, remove it from the used list
-                if (prev) {
-                    prev->next = current->next;
-                }
-                else {
-                    localHeaps.usedHead = current->next;  // Update head if it's the first block
-                }
+// Elastic local heap: a thread starts with LOCAL_REFILL_MIN, refills double it and spills
+// halve it again, and the thread keeps up to two refills' worth of free pages
+static size_t heapRefillSize(Heap* heap) {
+    return heap->refillSize ? heap->refillSize : LOCAL_REFILL_MIN;
+}
 
-                // Before adding to the free list, clear the next pointer
-                current->next = NULL;
+// Hand the largest free blocks to the home arena until at most keep bytes stay local
+static void spillToGlobal(Heap* heap, size_t keep) {
+    Arena* arena = &globalArenas[homeArena()];
 
-                // Add the block to the free list, keeping it sorted
-                addToHeap(&localHeaps.freeHead, current);
+    uint64_t now = nowMs();
 
-                break;
-            }
-            prev = current;
-            current = current->next;
+    pthread_mutex_lock(&arena->lock);
+    STAT_ADD(heap->stats.spills, 1);
+    while (heap->freeBytes > keep && heap->freeHead) {
+        MemoryBlock* block = heap->freeHead;
+        STAT_ADD(heap->stats.spilledBytes, block->length);
+        detachFree(heap, block);
+        if (block->pageState == PAGES_MUZZY || block->pageState == PAGES_DIRTY) {
+            block->pageState = PAGES_DIRTY;
+            block->freeSince = now;  // Decay starts once the pages reach the global tier
         }
+        insertFree(&arena->heap, block);
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    reclaimInline();
+}
 
-        if (current == NULL) {
-            // If we get here, it means the block was not found in the used list
-            //fprintf(stderr, "error free!\n");
+// Walk the arenas from home on, either those on node or those on every other node, and
+// take from the first one holding at least least bytes
+static MemoryBlock* takeFromNode(int home, int node, int sameNode, size_t least, size_t len, size_t want) {
+    int count = getArenaCount();
+    MemoryBlock* block = NULL;
+    for (int i = 0; i < count && !block; i++) {
+        Arena* arena = &globalArenas[(home + i) % count];
+        if ((arenaNode[(home + i) % count] == node) != sameNode ||
+            __atomic_load_n(&arena->heap.freeBytes, __ATOMIC_RELAXED) < least) {
+            continue;  // Unlocked peek, skips empty arenas without contending on them
         }
+        block = takeFromArena(arena, len, want);
     }
+    return block;
 }
 
-void reclaimMemory(int num_threads) {
-    srand(time(NULL));
-    unsigned int seed = time(NULL) ^ (omp_get_thread_num() << 16); // Seed the random number generator
-
-    // Randomly decide how many blocks to move and free
-    int blocks_to_reclaim = rand_r(&seed) % 3 + 1; // Move 1 to 3 blocks from local to global
-    int blocks_to_free = rand_r(&seed) % 3 + 1; // Free 1 to 3 blocks from global
-
-    int selected_thread_id = rand_r(&seed) % 3 + 1;
+// Move a chunk of at least len bytes from the global tier (or the system) into the local
+// free list. Besides the heap's own pageLock, this and spillToGlobal() are the only places
+// a thread synchronizes.
+// Before growing from the system the thread's own free pieces go back to its arena,
+// where they can coalesce with their neighbours.
+static int refillFromGlobal(Heap* heap, size_t len) {
+    size_t refill = heapRefillSize(heap);
+    size_t want = len > refill ? len : refill;
 
-    #pragma omp parallel num_threads(num_threads)
-    {
-        int thread_id = omp_get_thread_num();
+    // Home arena first, then steal from the neighbours on the same node
+    int home = homeArena();
+    int node = arenaNode[home];
+    MemoryBlock* block = takeFromNode(home, node, 1, len, len, want);
 
-        if (thread_id == selected_thread_id) {
-            // Perform memory reclaim only for the selected thread
-            #pragma omp critical(localHeaps)
-            {
-                MemoryBlock *prev = NULL, *current = localHeaps.freeHead;
-                int reclaimed_count = 0;
-
-                while (current != NULL && reclaimed_count < blocks_to_reclaim) {
-                    if (rand() % 2) { // Randomly decide to move this block
-                        if (prev) {
-                            prev->next = current->next;
-                        } else {
-                            localHeaps.freeHead = current->next;
-                        }
-
-                        MemoryBlock *toMove = current;
-                        current = current->next; // Move to the next block
-
-                        toMove->next = NULL;
-
-                        #pragma omp critical(globalHeap)
-                        {
-                            addToHeap(&globalHeap.freeHead, toMove);
-                        }
+    if (!block && heap->freeBytes > 0) {
+        // Local pieces may be what splits an arena range; merge them back and retry once
+        spillToGlobal(heap, 0);
+        block = takeFromArena(&globalArenas[home], len, want);
+    }
+    if (!block && numaNodes > 1) {
+        // Fresh local pages beat remote ones, unless another node is sitting on plenty
+        block = takeFromNode(home, node, 0, len > NUMA_REMOTE_MIN ? len : NUMA_REMOTE_MIN, len, want);
+        if (block) {
+            STAT_ADD(heap->stats.remoteNodeRefills, 1);
+        }
+    }
+    if (block) {
+        STAT_ADD(heap->stats.arenaRefills, 1);
+    }
 
-                        reclaimed_count++;
-                    } else {
-                        prev = current;
-                        current = current->next;
-                    }
-                }
+    if (!block) {
+        // Grow in big steps so the pieces carved from one system chunk can coalesce again
+        size_t chunk = want > GLOBAL_GROW_SIZE ? want : GLOBAL_GROW_SIZE;
+        if (__atomic_load_n(&hugePages, __ATOMIC_RELAXED)) {
+            chunk = (chunk + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);  // Whole huge pages only
+        }
+        char* memory = (char*)systemAlloc(chunk);
+        if (!memory) {
+            // Out of memory here; whatever another node has left is better than failing
+            block = numaNodes > 1 ? takeFromNode(home, node, 0, len, len, want) : NULL;
+            if (!block) {
+                return -1;
+            }
+            STAT_ADD(heap->stats.remoteNodeRefills, 1);
+            STAT_ADD(heap->stats.arenaRefills, 1);
+            insertFree(heap, block);
+            return 0;
+        }
+        bindToNode(memory, chunk, node);
+        block = newBlock(heap);
+        if (!block || recordChunk(memory, chunk) != 0) {
+            if (block) {
+                dropBlock(heap, block);
             }
+            munmap(memory, chunk);
+            return -1;
         }
+        __atomic_fetch_add(&heapMappedBytes, chunk, __ATOMIC_RELAXED);
+        STAT_ADD(heap->stats.systemGrows, 1);
+        block->start = memory;
+        block->length = want;
+        block->pageState = PAGES_CLEAN;
 
-        // Free blocks from global heap
-        if (omp_get_thread_num() == 0) { // Let only the master thread handle this
-            #pragma omp critical(globalHeap)
-            {
-                MemoryBlock *prev = NULL, *current = globalHeap.freeHead;
-                int freed_count = 0;
-
-                while (current != NULL && freed_count < blocks_to_free) {
-                    if (rand() % 2) { // Randomly decide to free this block
-                        if (prev) {
-                            prev->next = current->next;
-                        } else {
-                            globalHeap.freeHead = current->next;
-                        }
-
-                        MemoryBlock *toFree = current;
-                        current = current->next; // Move to the next block
-
-                        free(toFree); // Free the block
-                        freed_count++;
-                    } else {
-                        prev = current;
-                        current = current->next;
-                    }
-                }
+        if (chunk > want) {
+            Arena* arena = &globalArenas[home];
+            pthread_mutex_lock(&arena->lock);
+            MemoryBlock* rest = newBlock(&arena->heap);
+            if (rest) {
+                rest->start = memory + want;
+                rest->length = chunk - want;
+                rest->pageState = PAGES_CLEAN;
+                insertFree(&arena->heap, rest);
             }
+            pthread_mutex_unlock(&arena->lock);
         }
     }
+
+    insertFree(heap, block);
+
+    // A thread that keeps coming back gets twice as much next time
+    if (refill < LOCAL_REFILL_MAX) {
+        heap->refillSize = refill * 2;
+    }
+    return 0;
 }
 
-void freeMemoryAllocator(int num_threads) {
-    // Stop the background thread first
-    keep_running = 0;  // Assuming keep_running is a global volatile int used to control the reclaim thread
-    pthread_join(reclaim_thread, NULL);  // Wait for the reclaim thread to finish
+// Take a page-aligned block from the local heap, refilling it from the global heap first
+// if needed, and make it reachable from the page map.
+static MemoryBlock* allocateBlock(Heap* heap, size_t len, int sizeClass) {
+    pthread_mutex_lock(&heap->pageLock);
+    MemoryBlock* block = NULL;
+    if ((heap->freeHead && heap->freeHead->length >= len) || refillFromGlobal(heap, len) == 0) {
+        block = findAndDetachBlock(heap, len);
+    }
+    pthread_mutex_unlock(&heap->pageLock);
+    if (!block) {
+        return NULL;
+    }
+
+    block->sizeClass = sizeClass;
+    block->owner = heap;
+    if (pageMapRegister(block) != 0) {
+        // Unreachable from LYFree, so keep it out of circulation
+        block->sizeClass = 0;
+        return NULL;
+    }
+
+    if (sizeClass) {
+        STAT_ADD(heap->stats.runBytes, block->length);
+    }
+    else {
+        STAT_ADD(heap->stats.allocs[0], 1);
+        STAT_ADD(heap->stats.pageBytes, block->length);
+    }
+    return block;
+}
+
+// Bucket of the stack, created on first sight. Chains only grow and are published with a
+// release store, so LYMallocDumpProfile() walks them without the lock.
+static ProfileBucket* profileBucket(void** stack, int depth) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001b3ULL;
+    }
+    ProfileBucket** chain = &profileBuckets[hash % PROFILE_BUCKETS];
+
+    for (ProfileBucket* bucket = *chain; bucket != NULL; bucket = bucket->next) {
+        if (bucket->hash == hash && bucket->depth == depth &&
+            memcmp(bucket->stack, stack, depth * sizeof(void*)) == 0) {
+            return bucket;
+        }
+    }
+
+    ProfileBucket* bucket = (ProfileBucket*)metaAlloc(sizeof(ProfileBucket), MIN_ALIGNMENT);
+    if (bucket) {
+        bucket->hash = hash;
+        bucket->depth = depth;
+        memcpy(bucket->stack, stack, depth * sizeof(void*));
+        bucket->next = *chain;
+        __atomic_store_n(chain, bucket, __ATOMIC_RELEASE);
+    }
+    return bucket;
+}
+
+static void releaseSample(MemoryBlock* block) {
+    pthread_mutex_lock(&profileLock);
+    ProfileBucket* bucket = block->sample;
+    __atomic_store_n(&bucket->frees, bucket->frees + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->freeBytes, bucket->freeBytes + block->sampleSize, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&profileLock);
+    block->sample = NULL;
+}
+
+// Multi-producer push of a chain linked through first word, first to last: any thread may
+// add, only the owner takes the whole stack
+static void pushRemoteChain(Heap* heap, void* first, void* last) {
+    void* head = __atomic_load_n(&heap->remoteFree, __ATOMIC_RELAXED);
+    do {
+        *(void**)last = head;
+    } while (!__atomic_compare_exchange_n(&heap->remoteFree, &head, first, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void pushRemoteFree(Heap* heap, void* ptr) {
+    pushRemoteChain(heap, ptr, ptr);
+}
+
+// Put a detached block back on the local free list
+static void freePages(Heap* heap, MemoryBlock* block) {
+    pthread_mutex_lock(&heap->pageLock);
+    block->pageState = PAGES_DIRTY;
+    insertFree(heap, block);
+
+    size_t refill = heapRefillSize(heap);
+    if (heap->freeBytes > 2 * refill) {
+        // More comes back than the thread uses: shrink before handing the surplus on
+        if (refill > LOCAL_REFILL_MIN) {
+            heap->refillSize = refill / 2;
+        }
+        spillToGlobal(heap, heap->refillSize);
+    }
+    pthread_mutex_unlock(&heap->pageLock);
+}
+
+// Set the object's bit in its run. A run that gains its first free slot moves from usedHead
+// to the class's partial runs; an empty run goes back to the page heap unless it is the
+// only one the class could refill from while the cache still holds objects.
+static void returnToRun(Heap* heap, void* obj) {
+    MemoryBlock* run = pageMapGet(obj);
+    if (run->owner != heap) {
+        // Cached here by LYFreeSized(), which counted the free; the owner counts it when it drains
+        STAT_ADD(heap->stats.frees[run->sizeClass], -1);
+        pushRemoteFree(run->owner, obj);
+        return;
+    }
+
+    int sizeClass = run->sizeClass;
+    size_t slot = (size_t)((char*)obj - (char*)run->start) / classSizes[sizeClass];
+    run->freeMap[slot / 64] |= 1ULL << (slot % 64);
+    if (run->freeSlots++ == 0) {
+        removeFromHeap(&heap->usedHead, run);
+        pushBlock(&heap->classRuns[sizeClass], run);
+    }
+
+    if (run->freeSlots == run->slots &&
+        (run->next || run->prev || heap->classCount[sizeClass] == 0)) {
+        removeFromHeap(&heap->classRuns[sizeClass], run);
+        STAT_ADD(heap->stats.runBytes, -run->length);
+        freePages(heap, run);
+    }
+}
+
+// Keep the keep most recently freed objects of the class cache, return the rest to their runs
+static void flushClass(Heap* heap, int sizeClass, uint32_t keep) {
+    void** link = &heap->classFree[sizeClass];
+    uint32_t kept = 0;
+    while (kept < keep && *link) {
+        link = (void**)*link;
+        kept++;
+    }
+    void* obj = *link;
+    *link = NULL;
+    heap->classCount[sizeClass] = kept;
+
+    while (obj) {
+        void* next = *(void**)obj;
+        returnToRun(heap, obj);
+        obj = next;
+    }
+}
+
+static inline void pushClassFree(Heap* heap, void* ptr, int sizeClass) {
+    *(void**)ptr = heap->classFree[sizeClass];
+    heap->classFree[sizeClass] = ptr;
+    STAT_ADD(heap->stats.frees[sizeClass], 1);
+    if (__builtin_expect(++heap->classCount[sizeClass] > heap->classLimit[sizeClass], 0)) {
+        flushClass(heap, sizeClass, heap->classLimit[sizeClass] / 2);
+    }
+}
+
+// Return a pointer owned by the calling thread to its heap
+static void freeLocal(Heap* heap, MemoryBlock* block, void* ptr) {
+    if (block->sizeClass) {
+        // Object inside a size-class run: into the thread's class cache
+        pushClassFree(heap, ptr, block->sizeClass);
+    }
+    else if (block->start == ptr) {
+        if (block->sample) {
+            releaseSample(block);
+        }
+        STAT_ADD(heap->stats.frees[0], 1);
+        STAT_ADD(heap->stats.pageBytes, -block->length);
+        removeFromHeap(&heap->usedHead, block);
+        freePages(heap, block);
+    }
+}
+
+// Recycle everything other threads have freed into this heap in one batch
+static void drainRemoteFree(Heap* heap) {
+    if (__atomic_load_n(&heap->remoteFree, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    void* ptr = __atomic_exchange_n(&heap->remoteFree, NULL, __ATOMIC_ACQUIRE);
+    uint64_t count = 0;
+    while (ptr) {
+        void* next = *(void**)ptr;
+        freeLocal(heap, pageMapGet(ptr), ptr);
+        ptr = next;
+        count++;
+    }
+    STAT_ADD(heap->stats.remoteFrees, count);
+}
+
+static void orphanHeap(Heap* heap) {
+    heap->orphaned = 1;
+    heap->nextOrphan = orphanHeaps;
+    orphanHeaps = heap;
+}
+
+// Give every cached object back to its run and every free page to the arenas, where the
+// decay pass purges them; the heap starts over at LOCAL_REFILL_MIN
+static void emptyLocalHeap(Heap* heap) {
+    drainRemoteFree(heap);
+    for (int i = 1; i < NUM_SIZE_CLASSES; i++) {
+        if (heap->classFree[i]) {
+            flushClass(heap, i, 0);  // Runs left empty are released
+        }
+    }
+    pthread_mutex_lock(&heap->pageLock);
+    if (heap->freeBytes > 0) {
+        spillToGlobal(heap, 0);
+    }
+    pthread_mutex_unlock(&heap->pageLock);
+    heap->refillSize = 0;
+}
+
+// Thread exit: free pages go back to the arenas right away. The heap itself, with its runs
+// and whatever the thread left allocated, is orphaned until a new thread adopts it, so the
+// number of heaps follows the peak thread count rather than every thread ever started.
+static void releaseLocalHeap(void* arg) {
+    Heap* heap = (Heap*)arg;
+    emptyLocalHeap(heap);
+    LYLocalHeap = NULL;  // Frees from later destructors go through remoteFree
+
+    pthread_mutex_lock(&heapListLock);
+    orphanHeap(heap);
+    pthread_mutex_unlock(&heapListLock);
+}
+
+static void createHeapKey(void) {
+    heapKeyReady = pthread_key_create(&heapKey, releaseLocalHeap) == 0;
+}
+
+// Slow path of getLocalHeap(): first allocation on this thread, OpenMP or plain pthread.
+// An orphaned heap is adopted before a new one is made.
+static Heap* createLocalHeap(void) {
+    pthread_once(&heapKeyOnce, createHeapKey);
+
+    pthread_mutex_lock(&heapListLock);
+    Heap* heap = orphanHeaps;
+    if (heap) {
+        orphanHeaps = heap->nextOrphan;
+        heap->nextOrphan = NULL;
+        heap->orphaned = 0;
+    }
+    pthread_mutex_unlock(&heapListLock);
+
+    if (!heap) {
+        heap = (Heap*)metaAlloc(sizeof(Heap), CACHE_LINE_SIZE);
+        if (!heap) {
+            return NULL;
+        }
+        pthread_mutex_init(&heap->pageLock, NULL);
+        pthread_mutex_lock(&heapListLock);
+        heap->nextHeap = allHeaps;
+        allHeaps = heap;
+        pthread_mutex_unlock(&heapListLock);
+    }
+
+    LYLocalHeap = heap;
+    if (heapKeyReady) {
+        pthread_setspecific(heapKey, heap);  // May allocate, which now finds LYLocalHeap set
+    }
+    return heap;
+}
+
+static inline Heap* getLocalHeap(void) {
+    Heap* heap = LYLocalHeap;
+    if (__builtin_expect(heap == NULL, 0)) {
+        heap = createLocalHeap();
+    }
+    return heap;
+}
+
+// Bit i set when word i of the run's free map has a free slot
+static inline unsigned runMapWords(const MemoryBlock* run) {
+#if defined(__AVX2__) && RUN_MAP_WORDS == 4
+    __m256i map = _mm256_loadu_si256((const __m256i*)run->freeMap);
+    __m256i empty = _mm256_cmpeq_epi64(map, _mm256_setzero_si256());
+    return ~(unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(empty)) & 0xF;
+#else
+    unsigned words = 0;
+    for (int i = 0; i < RUN_MAP_WORDS; i++) {
+        if (run->freeMap[i]) {
+            words |= 1u << i;
+        }
+    }
+    return words;
+#endif
+}
+
+// Move every free slot of a partial run onto the class cache, lowest address first; the run
+// is full again and goes back on usedHead
+static void takeRunSlots(Heap* heap, MemoryBlock* run) {
+    int sizeClass = run->sizeClass;
+    size_t objSize = classSizes[sizeClass];
+    char* base = (char*)run->start;
+    void* head = NULL;
+    void** tail = &head;
+
+    for (unsigned words = runMapWords(run); words; words &= words - 1) {
+        int word = __builtin_ctz(words);
+        uint64_t bits = run->freeMap[word];
+        run->freeMap[word] = 0;
+        for (; bits; bits &= bits - 1) {
+            void* obj = base + ((size_t)word * 64 + __builtin_ctzll(bits)) * objSize;
+            *tail = obj;
+            tail = (void**)obj;
+        }
+    }
+    *tail = heap->classFree[sizeClass];
+    heap->classFree[sizeClass] = head;
+    heap->classCount[sizeClass] += run->freeSlots;
+
+    run->freeSlots = 0;
+    removeFromHeap(&heap->classRuns[sizeClass], run);
+    pushBlock(&heap->usedHead, run);
+}
+
+// Carve a run for the size class; all its slots go straight into the class cache
+static int carveRun(Heap* heap, int sizeClass) {
+    size_t objSize = classSizes[sizeClass];
+    size_t count = RUN_SIZE / objSize;
+    if (count == 0) {
+        count = 1;
+    }
+    else if (count > MAX_RUN_OBJECTS) {
+        count = MAX_RUN_OBJECTS;
+    }
+    size_t len = (objSize * count + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    MemoryBlock* run = allocateBlock(heap, len, sizeClass);
+    if (!run) {
+        return -1;
+    }
+    STAT_ADD(heap->stats.classRefills, 1);
+
+    count = run->length / objSize;
+    if (count > MAX_RUN_OBJECTS) {
+        count = MAX_RUN_OBJECTS;
+    }
+    run->slots = (uint32_t)count;
+    run->freeSlots = 0;
+    memset(run->freeMap, 0, sizeof(run->freeMap));
+
+    char* first = (char*)run->start;
+    for (size_t i = count; i > 0; i--) {
+        void* obj = first + (i - 1) * objSize;
+        *(void**)obj = heap->classFree[sizeClass];
+        heap->classFree[sizeClass] = obj;
+    }
+    heap->classCount[sizeClass] += count;
+    heap->classLimit[sizeClass] = 2 * count;
+    return 0;
+}
+
+// Refill the empty class cache from a partial run, or from a new one
+static void* refillClass(Heap* heap, int sizeClass) {
+    if (heap->classRuns[sizeClass]) {
+        takeRunSlots(heap, heap->classRuns[sizeClass]);
+    }
+    else if (carveRun(heap, sizeClass) != 0) {
+        return NULL;
+    }
+
+    void* obj = heap->classFree[sizeClass];
+    heap->classFree[sizeClass] = *(void**)obj;
+    heap->classCount[sizeClass]--;
+    return obj;
+}
+
+static void* allocateSmallSlow(Heap* heap, int sizeClass) {
+    STAT_ADD(heap->stats.slowAllocs, 1);
+    drainRemoteFree(heap);
+
+    void* obj = heap->classFree[sizeClass];
+    if (obj) {
+        heap->classFree[sizeClass] = *(void**)obj;
+        heap->classCount[sizeClass]--;
+        return obj;
+    }
+    return refillClass(heap, sizeClass);
+}
+
+void LYSetMmapThreshold(size_t bytes) {
+    // Size-class objects always come from the heaps
+    mmapThreshold = bytes > MAX_SMALL_SIZE ? bytes : MAX_SMALL_SIZE + 1;
+}
+
+static void* allocateLarge(size_t size, size_t alignment) {
+    if (size > PTRDIFF_MAX || alignment > PTRDIFF_MAX) {
+        return NULL;  // Page rounding would wrap
+    }
+    size_t len = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    MemoryBlock* block = NULL;
+
+    pthread_mutex_lock(&largeLock);
+    // Reuse the smallest cached mapping that fits
+    int best = -1;
+    for (int i = 0; i < MMAP_CACHE_SLOTS; i++) {
+        if (mmapCache[i] && mmapCache[i]->length >= len &&
+            ((uintptr_t)mmapCache[i]->start & (alignment - 1)) == 0 &&
+            (best < 0 || mmapCache[i]->length < mmapCache[best]->length)) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        block = mmapCache[best];
+        mmapCache[best] = NULL;
+        mmapCacheBytes -= block->length;
+        largeCacheHits++;
+    }
+    else {
+        block = newBlock(&largeHeap);
+    }
+    pthread_mutex_unlock(&largeLock);
+
+    if (!block) {
+        return NULL;
+    }
+
+    if (block->start) {
+        if (block->length > len) {
+            munmap((char*)block->start + len, block->length - len);  // Trim the cached mapping
+            block->length = len;
+        }
+    }
+    else {
+        int huge = __atomic_load_n(&hugePages, __ATOMIC_RELAXED) && len >= HUGE_PAGE_SIZE;
+        if (huge && alignment < HUGE_PAGE_SIZE) {
+            alignment = HUGE_PAGE_SIZE;
+        }
+        // Over-map for alignments above a page, then unmap the slack on both sides
+        size_t mapLength = alignment > PAGE_SIZE ? len + alignment - PAGE_SIZE : len;
+        char* memory = mmap(NULL, mapLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            pthread_mutex_lock(&largeLock);
+            dropBlock(&largeHeap, block);
+            pthread_mutex_unlock(&largeLock);
+            return NULL;
+        }
+        char* aligned = (char*)(((uintptr_t)memory + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        if (aligned > memory) {
+            munmap(memory, aligned - memory);
+        }
+        if (memory + mapLength > aligned + len) {
+            munmap(aligned + len, memory + mapLength - (aligned + len));
+        }
+        if (huge) {
+            adviseHugePages(aligned, len);
+        }
+        block->start = aligned;
+        block->length = len;
+        block->pageState = PAGES_CLEAN;  // Fresh anonymous pages, LYCalloc need not clear them
+    }
+    block->mapped = 1;
+
+    pthread_mutex_lock(&largeLock);
+    if (pageMapRegister(block) != 0) {
+        munmap(block->start, block->length);
+        block->start = NULL;
+        dropBlock(&largeHeap, block);
+        block = NULL;
+    }
+    else {
+        pushBlock(&largeHeap.usedHead, block);
+        largeAllocs++;
+        largeLiveBytes += block->length;
+    }
+    pthread_mutex_unlock(&largeLock);
+
+    return block ? block->start : NULL;
+}
+
+// Any thread may free a mapping; it is cached if it fits, otherwise unmapped right away
+static void freeLarge(MemoryBlock* block) {
+    if (block->sample) {
+        releaseSample(block);
+    }
+
+    pthread_mutex_lock(&largeLock);
+    pageMapUnregister(block);
+    removeFromHeap(&largeHeap.usedHead, block);
+    largeFrees++;
+    largeLiveBytes -= block->length;
+
+    if (block->length <= MMAP_CACHE_BYTES / 2) {
+        // Make room by evicting the oldest entries
+        while (mmapCache[mmapCacheNext] || mmapCacheBytes + block->length > MMAP_CACHE_BYTES) {
+            MemoryBlock* victim = mmapCache[mmapCacheNext];
+            if (victim) {
+                munmap(victim->start, victim->length);
+                mmapCacheBytes -= victim->length;
+                victim->start = NULL;
+                dropBlock(&largeHeap, victim);
+                mmapCache[mmapCacheNext] = NULL;
+            }
+            if (mmapCacheBytes + block->length <= MMAP_CACHE_BYTES) {
+                break;
+            }
+            mmapCacheNext = (mmapCacheNext + 1) % MMAP_CACHE_SLOTS;
+        }
+        block->freeSince = nowMs();
+        block->pageState = PAGES_DIRTY;
+        mmapCache[mmapCacheNext] = block;
+        mmapCacheBytes += block->length;
+        mmapCacheNext = (mmapCacheNext + 1) % MMAP_CACHE_SLOTS;
+        block = NULL;
+    }
+
+    if (block) {
+        munmap(block->start, block->length);
+        block->start = NULL;
+        dropBlock(&largeHeap, block);
+    }
+    pthread_mutex_unlock(&largeLock);
+
+    reclaimInline();
+}
+
+void LYSetProfileRate(size_t meanBytes) {
+    if (meanBytes) {
+        // The first backtrace() loads the unwinder, which allocates; do it here, not mid-sample
+        void* frame;
+        backtrace(&frame, 1);
+    }
+    __atomic_store_n(&profileRate, meanBytes, __ATOMIC_RELAXED);
+}
+
+// Exponentially distributed gap with the given mean, so sampling is a Poisson process over
+// allocated bytes and every byte has the same chance of being sampled
+static int64_t nextSampleGap(Heap* heap, size_t rate) {
+    uint64_t x = heap->sampleSeed;
+    if (x == 0) {
+        x = ((uintptr_t)heap >> 6) ^ (nowMs() << 20) ^ 0x9E3779B97F4A7C15ULL;
+    }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    heap->sampleSeed = x;
+
+    double u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);  // (0, 1]
+    double gap = -log(u) * rate;
+    return gap < INT64_MAX / 2 ? (int64_t)gap + 1 : INT64_MAX / 2;
+}
+
+// Countdown expired: take a sample, or just re-arm the countdown while profiling is off.
+// Sampled objects get a page block (or mapping) of their own, so LYFree finds the sample on
+// the descriptor it already looks up. Returns NULL when the caller should allocate normally.
+__attribute__((noinline))
+static void* allocateSampled(Heap* heap, size_t size) {
+    size_t rate = __atomic_load_n(&profileRate, __ATOMIC_RELAXED);
+    heap->sampleCountdown = rate ? nextSampleGap(heap, rate) : PROFILE_RECHECK_BYTES;
+    if (!rate || heap->sampling) {
+        return NULL;
+    }
+
+    heap->sampling = 1;
+    void* stack[PROFILE_MAX_DEPTH + 1];
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + 1) - 1;  // Without this frame
+
+    void* ptr = NULL;
+    MemoryBlock* block = NULL;
+    if (size >= mmapThreshold) {
+        ptr = allocateLarge(size, PAGE_SIZE);
+        block = ptr ? pageMapGet(ptr) : NULL;
+    }
+    else {
+        size_t len = size ? (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1) : PAGE_SIZE;
+        block = allocateBlock(heap, len, 0);
+        ptr = block ? block->start : NULL;
+    }
+
+    if (block) {
+        __atomic_store_n(&profileSampled, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&profileLock);
+        ProfileBucket* bucket = depth > 0 ? profileBucket(stack + 1, depth) : NULL;
+        if (bucket) {
+            __atomic_store_n(&bucket->allocs, bucket->allocs + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&bucket->allocBytes, bucket->allocBytes + size, __ATOMIC_RELAXED);
+            block->sample = bucket;
+            block->sampleSize = size;
+        }
+        pthread_mutex_unlock(&profileLock);
+    }
+    heap->sampling = 0;
+    return ptr;
+}
+
+void* LYMalloc(size_t size) {
+    Heap* heap = getLocalHeap();
+    if (!heap) {
+        return NULL;
+    }
+    // The only cost of profiling for unsampled allocations
+    heap->sampleCountdown -= (int64_t)size;
+    if (__builtin_expect(heap->sampleCountdown < 0, 0)) {
+        void* ptr = allocateSampled(heap, size);
+        if (ptr) {
+            return ptr;
+        }
+    }
+
+    // Small requests: index computation plus a pop from the class free list
+    if (size <= MAX_SMALL_SIZE) {
+        int sizeClass = sizeToClass(size);
+        void* obj = heap->classFree[sizeClass];
+        if (__builtin_expect(obj != NULL, 1)) {
+            heap->classFree[sizeClass] = *(void**)obj;
+            heap->classCount[sizeClass]--;
+            STAT_ADD(heap->stats.allocs[sizeClass], 1);
+            return obj;
+        }
+        obj = allocateSmallSlow(heap, sizeClass);
+        if (obj) {
+            STAT_ADD(heap->stats.allocs[sizeClass], 1);
+        }
+        return obj;
+    }
+
+    if (size >= mmapThreshold) {
+        return allocateLarge(size, PAGE_SIZE);
+    }
+
+    // Larger requests take whole pages from the sorted free lists
+    size_t len = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (!heap->freeHead || heap->freeHead->length < len) {
+        drainRemoteFree(heap);
+    }
+    MemoryBlock* block = allocateBlock(heap, len, 0);
+    return block ? block->start : NULL;
+}
+
+void LYFree(void* ptr) {
+    if (ptr == NULL)
+        return;
+
+    // The page map leads straight to the block, no list is searched
+    MemoryBlock* block = pageMapGet(ptr);
+    if (block != NULL && block->mapped && block->start == ptr) {
+        freeLarge(block);
+        return;
+    }
+    if (block == NULL || block->owner == NULL) {
+        //fprintf(stderr, "error free!\n");
+        return;
+    }
+
+    Heap* heap = LYLocalHeap;
+    if (block->owner != heap) {
+        // Allocated by another thread: hand it back without taking any lock
+        pushRemoteFree(block->owner, ptr);
+        return;
+    }
+
+    freeLocal(heap, block, ptr);
+}
+
+// Fills out with up to count objects of size bytes and returns how many it got. Small sizes
+// pop straight off the class free list, refilling it as often as needed, with no lock.
+size_t LYMallocBatch(size_t size, size_t count, void** out) {
+    size_t n = 0;
+    if (size > MAX_SMALL_SIZE) {
+        while (n < count && (out[n] = LYMalloc(size)) != NULL) {
+            n++;
+        }
+        return n;
+    }
+
+    Heap* heap = getLocalHeap();
+    if (!heap || count == 0) {
+        return 0;
+    }
+
+    // The whole batch counts toward the sampling countdown; at most one of it is sampled
+    int64_t bytes;
+    if (__builtin_mul_overflow((int64_t)size, (int64_t)count, &bytes)) {
+        bytes = INT64_MAX / 2;
+    }
+    heap->sampleCountdown -= bytes;
+    if (__builtin_expect(heap->sampleCountdown < 0, 0)) {
+        void* ptr = allocateSampled(heap, size);
+        if (ptr) {
+            out[n++] = ptr;
+        }
+    }
+
+    int sizeClass = sizeToClass(size);
+    size_t first = n;
+    while (n < count) {
+        void* obj = heap->classFree[sizeClass];
+        size_t popped = n;
+        while (obj && n < count) {
+            out[n++] = obj;
+            obj = *(void**)obj;
+        }
+        heap->classFree[sizeClass] = obj;
+        heap->classCount[sizeClass] -= (uint32_t)(n - popped);
+        if (n == count) {
+            break;
+        }
+        obj = allocateSmallSlow(heap, sizeClass);
+        if (!obj) {
+            break;
+        }
+        out[n++] = obj;
+    }
+    STAT_ADD(heap->stats.allocs[sizeClass], n - first);
+    return n;
+}
+
+// Frees count pointers (NULL entries are skipped). Objects owned by the calling thread go
+// back to its lists; runs of objects owned by the same other thread are chained and handed
+// over with a single compare-and-swap.
+void LYFreeBatch(void** ptrs, size_t count) {
+    Heap* heap = LYLocalHeap;
+    Heap* remote = NULL;
+    void* chainFirst = NULL;
+    void* chainLast = NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        void* ptr = ptrs[i];
+        if (ptr == NULL) {
+            continue;
+        }
+        MemoryBlock* block = pageMapGet(ptr);
+        if (block != NULL && block->mapped && block->start == ptr) {
+            freeLarge(block);
+            continue;
+        }
+        if (block == NULL || block->owner == NULL) {
+            continue;
+        }
+        if (block->owner == heap) {
+            freeLocal(heap, block, ptr);
+            continue;
+        }
+
+        if (block->owner != remote) {
+            if (chainFirst) {
+                pushRemoteChain(remote, chainFirst, chainLast);
+            }
+            remote = block->owner;
+            chainFirst = NULL;
+            chainLast = ptr;
+        }
+        *(void**)ptr = chainFirst;
+        chainFirst = ptr;
+    }
+    if (chainFirst) {
+        pushRemoteChain(remote, chainFirst, chainLast);
+    }
+}
+
+// Free with the size passed to LYMalloc/LYCalloc/LYMallocBatch. Small objects go onto the
+// calling thread's class free list without touching the page map or the block descriptor,
+// whichever thread allocated them: the run stays with its owner, the object is just reused
+// here. Memory from LYAlignedAlloc or LYRealloc, and sampled objects, take the LYFree path.
+void LYFreeSized(void* ptr, size_t size) {
+    Heap* heap = LYLocalHeap;
+    if (ptr == NULL) {
+        return;
+    }
+    if (size > MAX_SMALL_SIZE || heap == NULL || __atomic_load_n(&profileSampled, __ATOMIC_RELAXED)) {
+        LYFree(ptr);
+        return;
+    }
+
+    pushClassFree(heap, ptr, sizeToClass(size));
+}
+
+// Page block whose start is a multiple of alignment (> PAGE_SIZE): over-allocate from the
+// local heap and give the slack on both sides back to its free list.
+static void* allocateAlignedBlock(Heap* heap, size_t len, size_t alignment) {
+    MemoryBlock* block = allocateBlock(heap, len + alignment - PAGE_SIZE, 0);
+    if (!block) {
+        return NULL;
+    }
+
+    char* start = (char*)block->start;
+    char* end = start + block->length;
+    char* aligned = (char*)(((uintptr_t)start + alignment - 1) & ~(uintptr_t)(alignment - 1));
+
+    MemoryBlock* front = aligned > start ? newBlock(heap) : NULL;
+    MemoryBlock* back = end > aligned + len ? newBlock(heap) : NULL;
+    if ((aligned > start && !front) || (end > aligned + len && !back)) {
+        if (front) {
+            dropBlock(heap, front);
+        }
+        if (back) {
+            dropBlock(heap, back);
+        }
+        freeLocal(heap, block, start);
+        return NULL;
+    }
+
+    STAT_ADD(heap->stats.pageBytes, len - block->length);
+    block->start = aligned;
+    block->length = len;
+    pageMapRegister(block);
+
+    pthread_mutex_lock(&heap->pageLock);
+    if (front) {
+        front->start = start;
+        front->length = aligned - start;
+        front->pageState = block->pageState;
+        insertFree(heap, front);
+    }
+    if (back) {
+        back->start = aligned + len;
+        back->length = end - (aligned + len);
+        back->pageState = block->pageState;
+        insertFree(heap, back);
+    }
+    pthread_mutex_unlock(&heap->pageLock);
+    return aligned;
+}
+
+void* LYAlignedAlloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= MIN_ALIGNMENT) {
+        return LYMalloc(size);
+    }
+
+    if (size <= MAX_SMALL_SIZE && alignment <= PAGE_SIZE) {
+        // Runs start on a page, so any class whose size is a multiple of the alignment works
+        int sizeClass = sizeToClass(size);
+        while (classSizes[sizeClass] % alignment != 0) {
+            sizeClass++;
+        }
+        return LYMalloc(classSizes[sizeClass]);
+    }
+
+    // Every block covers at least one page, a zero length one would map the page before it
+    if (size == 0) {
+        size = 1;
+    }
+    if (size >= mmapThreshold || alignment >= mmapThreshold) {
+        return allocateLarge(size, alignment > PAGE_SIZE ? alignment : PAGE_SIZE);
+    }
+
+    // Page blocks are page aligned already
+    size_t len = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (alignment <= PAGE_SIZE) {
+        return LYMalloc(len > MAX_SMALL_SIZE ? len : MAX_SMALL_SIZE + 1);
+    }
+
+    Heap* heap = getLocalHeap();
+    return heap ? allocateAlignedBlock(heap, len, alignment) : NULL;
+}
+
+int LYPosixMemalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    void* ptr = LYAlignedAlloc(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void* LYCalloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void* ptr = LYMalloc(total);
+    if (!ptr) {
+        return NULL;
+    }
+
+    // Whole pages that were never touched, or were purged with MADV_DONTNEED, are already zero
+    MemoryBlock* block = pageMapGet(ptr);
+    if (block && !block->sizeClass && block->pageState == PAGES_CLEAN) {
+        block->pageState = PAGES_DIRTY;
+        return ptr;
+    }
+
+    memset(ptr, 0, total);
+    return ptr;
+}
+
+size_t LYUsableSize(void* ptr) {
+    MemoryBlock* block = ptr ? pageMapGet(ptr) : NULL;
+    if (!block) {
+        return 0;
+    }
+    if (block->sizeClass) {
+        return classSizes[block->sizeClass];
+    }
+    return block->length - ((char*)ptr - (char*)block->start);
+}
+
+// Extend a page block of the calling thread into the free block that follows it
+static int growInPlace(Heap* heap, MemoryBlock* block, size_t len) {
+    char* end = (char*)block->start + block->length;
+    pthread_mutex_lock(&heap->pageLock);
+    MemoryBlock* right = pageMapGet(end);
+    if (!right || __atomic_load_n(&right->freeHeap, __ATOMIC_RELAXED) != heap ||
+        (char*)right->start != end || block->length + right->length < len) {
+        pthread_mutex_unlock(&heap->pageLock);
+        return 0;
+    }
+
+    size_t need = len - block->length;
+    detachFree(heap, right);
+    STAT_ADD(heap->stats.pageBytes, need);
+
+    block->length = len;
+    pageMapRegister(block);
+
+    if (right->length > need) {
+        right->start = (char*)right->start + need;
+        right->length -= need;
+        insertFree(heap, right);
+    }
+    else {
+        dropBlock(heap, right);
+    }
+    pthread_mutex_unlock(&heap->pageLock);
+    return 1;
+}
+
+// Give the pages past len back to the calling thread's free list
+static void shrinkInPlace(Heap* heap, MemoryBlock* block, size_t len) {
+    MemoryBlock* tail = newBlock(heap);
+    if (!tail) {
+        return;
+    }
+    tail->start = (char*)block->start + len;
+    tail->length = block->length - len;
+    tail->pageState = PAGES_DIRTY;
+    STAT_ADD(heap->stats.pageBytes, -tail->length);
+
+    block->length = len;
+    pageMapRegister(block);
+    pthread_mutex_lock(&heap->pageLock);
+    insertFree(heap, tail);
+    pthread_mutex_unlock(&heap->pageLock);
+}
+
+static void* resizeMapping(MemoryBlock* block, size_t len) {
+    pthread_mutex_lock(&largeLock);
+    void* memory = mremap(block->start, block->length, len, MREMAP_MAYMOVE);
+    if (memory != MAP_FAILED) {
+        pageMapUnregister(block);
+        largeLiveBytes += len - block->length;
+        block->start = memory;
+        block->length = len;
+        pageMapRegister(block);
+    }
+    pthread_mutex_unlock(&largeLock);
+
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+void* LYRealloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return LYMalloc(size);
+    }
+    if (size == 0) {
+        LYFree(ptr);
+        return NULL;
+    }
+
+    MemoryBlock* block = pageMapGet(ptr);
+    if (!block) {
+        return NULL;
+    }
+    size_t usable = LYUsableSize(ptr);
+
+    if (block->sizeClass) {
+        // The class has slack: stay put unless the object would be mostly empty
+        if (size <= usable && (size > usable / 2 || usable <= 16)) {
+            return ptr;
+        }
+    }
+    else if (block->mapped && block->start == ptr) {
+        if (size >= mmapThreshold / 2) {
+            size_t len = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+            if (len == block->length) {
+                return ptr;
+            }
+            void* memory = resizeMapping(block, len);  // The kernel moves page tables, not bytes
+            if (memory) {
+                return memory;
+            }
+        }
+    }
+    else if (block->start == ptr && block->owner == LYLocalHeap && size > MAX_SMALL_SIZE && size < mmapThreshold) {
+        size_t len = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if (len <= block->length) {
+            if (block->length - len >= PAGE_SIZE) {
+                shrinkInPlace(LYLocalHeap, block, len);
+            }
+            return ptr;
+        }
+        if (growInPlace(LYLocalHeap, block, len)) {
+            return ptr;
+        }
+    }
+
+    void* newPtr = LYMalloc(size);
+    if (!newPtr) {
+        return NULL;
+    }
+    memcpy(newPtr, ptr, usable < size ? usable : size);
+    LYFree(ptr);
+    return newPtr;
+}
+
+// Region allocator: chunks are ordinary page blocks of the creating thread's heap, carved
+// with a pointer bump. Reset rewinds to the first chunk and keeps the rest for reuse;
+// destroy frees them, so they are recycled through the local and global heaps.
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;  // Chunks in the order they are reused after a reset
+    char* end;
+} ArenaChunk;
+
+struct LYArena {
+    ArenaChunk* head;  // First chunk, which also holds this struct
+    ArenaChunk* current;
+    char* cursor;
+    char* end;
+    size_t chunkSize;
+};
+
+#define ARENA_ROUND(n) (((n) + MIN_ALIGNMENT - 1) & ~(size_t)(MIN_ALIGNMENT - 1))
+#define ARENA_CHUNK_HEADER ARENA_ROUND(sizeof(ArenaChunk))
+#define ARENA_HEAD_HEADER (ARENA_CHUNK_HEADER + ARENA_ROUND(sizeof(LYArena)))
+
+static ArenaChunk* arenaNewChunk(size_t size) {
+    ArenaChunk* chunk = LYMalloc(size);
+    if (chunk) {
+        chunk->next = NULL;
+        chunk->end = (char*)chunk + size;
+    }
+    return chunk;
+}
+
+LYArena* LYArenaCreate(size_t chunkSize) {
+    if (chunkSize == 0) {
+        chunkSize = ARENA_CHUNK_SIZE;
+    }
+    if (chunkSize > PTRDIFF_MAX) {
+        return NULL;
+    }
+    // Whole pages above the class sizes, so every chunk is a page block or a mapping
+    chunkSize = (chunkSize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (chunkSize <= MAX_SMALL_SIZE) {
+        chunkSize = MAX_SMALL_SIZE + PAGE_SIZE;
+    }
+
+    ArenaChunk* chunk = arenaNewChunk(chunkSize);
+    if (!chunk) {
+        return NULL;
+    }
+    LYArena* arena = (LYArena*)((char*)chunk + ARENA_CHUNK_HEADER);
+    arena->head = chunk;
+    arena->chunkSize = chunkSize;
+    LYArenaReset(arena);
+    return arena;
+}
+
+// The current chunk is full: move on to the next kept chunk that fits, or add a chunk after
+// the current one. Requests bigger than a chunk get a chunk of their own size.
+__attribute__((noinline))
+static void* arenaAllocSlow(LYArena* arena, size_t size) {
+    if (size > PTRDIFF_MAX - ARENA_CHUNK_HEADER - PAGE_SIZE) {
+        return NULL;
+    }
+    size_t len = ARENA_ROUND(size);
+
+    ArenaChunk* chunk = arena->current->next;
+    while (chunk && (size_t)(chunk->end - (char*)chunk) - ARENA_CHUNK_HEADER < len) {
+        chunk = chunk->next;
+    }
+    if (!chunk) {
+        size_t chunkSize = arena->chunkSize;
+        if (len + ARENA_CHUNK_HEADER > chunkSize) {
+            chunkSize = (len + ARENA_CHUNK_HEADER + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        }
+        chunk = arenaNewChunk(chunkSize);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+    }
+
+    char* ptr = (char*)chunk + ARENA_CHUNK_HEADER;
+    arena->current = chunk;
+    arena->cursor = ptr + len;
+    arena->end = chunk->end;
+    return ptr;
+}
+
+// Bump allocation, MIN_ALIGNMENT aligned. Not thread-safe: an arena belongs to one thread
+// at a time.
+void* LYArenaAlloc(LYArena* arena, size_t size) {
+    size_t len = ARENA_ROUND(size);
+    if (__builtin_expect(len >= size && len <= (size_t)(arena->end - arena->cursor), 1)) {
+        void* ptr = arena->cursor;
+        arena->cursor += len;
+        return ptr;
+    }
+    return arenaAllocSlow(arena, size);
+}
+
+// Drop every object at once; the chunks stay with the arena for the next round
+void LYArenaReset(LYArena* arena) {
+    arena->current = arena->head;
+    arena->cursor = (char*)arena->head + ARENA_HEAD_HEADER;
+    arena->end = arena->head->end;
+}
+
+// Hand the chunks back to the heap that allocated them; any thread may call it
+void LYArenaDestroy(LYArena* arena) {
+    if (arena == NULL) {
+        return;
+    }
+    ArenaChunk* chunk = arena->head->next;
+    while (chunk) {
+        ArenaChunk* next = chunk->next;
+        LYFree(chunk);
+        chunk = next;
+    }
+    LYFree(arena->head);
+}
 
-    // Free global heap memory
-    MemoryBlock *block = globalHeap.freeHead;
+// Bytes of the whole huge pages inside a block, starting at *first
+static size_t hugeInterior(const MemoryBlock* block, char** first) {
+    char* start = (char*)block->start;
+    char* end = start + block->length;
+    *first = (char*)(((uintptr_t)start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    char* last = (char*)((uintptr_t)end & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    return last > *first ? (size_t)(last - *first) : 0;
+}
+
+// Release the pages of a detached block according to its decay stage; returns the bytes
+// released. In huge page mode only whole, aligned huge pages are released so no huge page is
+// split: a block with a ragged edge gives back its interior and becomes PAGES_PARTIAL, which
+// the decay pass leaves alone until the block is reused or merged with a neighbour.
+static size_t purgeBlock(MemoryBlock* block, uint64_t now, long dirtyMs, long muzzyMs) {
+    if (__atomic_load_n(&hugePages, __ATOMIC_RELAXED)) {
+        char* first;
+        size_t interior = hugeInterior(block, &first);
+        if (first != (char*)block->start || interior != block->length) {
+            if (interior == 0) {
+                block->freeSince = now;  // Nothing whole yet; check again next period
+                return 0;
+            }
+            if (madvise(first, interior, MADV_DONTNEED) != 0) {
+                return 0;
+            }
+            block->pageState = PAGES_PARTIAL;
+            return interior;
+        }
+    }
+#ifdef MADV_FREE
+    if (block->pageState == PAGES_DIRTY && muzzyMs > 0 &&
+        madvise(block->start, block->length, MADV_FREE) == 0) {
+        block->pageState = PAGES_MUZZY;  // Kernel may reclaim lazily; pages keep their contents until then
+        block->freeSince = now;
+        return block->length;
+    }
+#endif
+    if (madvise(block->start, block->length, MADV_DONTNEED) != 0) {
+        return 0;
+    }
+    block->pageState = PAGES_CLEAN;  // Next touch faults in zero pages
+    return block->length;
+}
+
+// Purge in place the free pages of heaps whose thread has neither allocated nor freed for
+// dirtyMs, the same way the arenas decay. Busy heaps shrink on their own in freePages(), and
+// a heap whose owner holds pageLock is busy, so it is skipped. Returns the bytes released.
+static size_t purgeIdleHeaps(uint64_t now, long dirtyMs, long muzzyMs) {
+    size_t released = 0;
+    pthread_mutex_lock(&heapListLock);
+    for (Heap* heap = allHeaps; heap != NULL; heap = heap->nextHeap) {
+        if (heap->orphaned) {
+            continue;
+        }
+        uint64_t ops = 0;
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            ops += STAT_LOAD(heap->stats.allocs[i]) + STAT_LOAD(heap->stats.frees[i]);
+        }
+        if (ops != heap->idleOps || heap->idleSince == 0) {
+            heap->idleOps = ops;
+            heap->idleSince = now;
+            continue;
+        }
+        if (now - heap->idleSince < (uint64_t)dirtyMs || STAT_LOAD(heap->freeBytes) == 0 ||
+            pthread_mutex_trylock(&heap->pageLock) != 0) {
+            continue;
+        }
+        // Idle for dirtyMs, so every dirty block has been free at least that long
+        for (MemoryBlock* block = heap->freeHead; block != NULL; block = block->next) {
+            if (block->pageState == PAGES_DIRTY ||
+                (block->pageState == PAGES_MUZZY && now - block->freeSince >= (uint64_t)muzzyMs)) {
+                released += purgeBlock(block, now, dirtyMs, muzzyMs);
+            }
+        }
+        pthread_mutex_unlock(&heap->pageLock);
+    }
+    pthread_mutex_unlock(&heapListLock);
+    return released;
+}
+
+// Local heaps hand their surplus to the global tier themselves (spillToGlobal), so the
+// background pass only has to decay the arena free lists and the mmap cache, and the free
+// pages of heaps that went idle (purgeIdleHeaps).
+// Expired blocks are detached under the arena lock, purged without it, and put back.
+void reclaimMemory(void) {
+    long dirtyMs = __atomic_load_n(&dirtyDecayMs, __ATOMIC_RELAXED);
+    long muzzyMs = __atomic_load_n(&muzzyDecayMs, __ATOMIC_RELAXED);
+    if (dirtyMs < 0) {
+        return;
+    }
+
+    uint64_t now = nowMs();
+    int count = getArenaCount();
+    uint64_t released = 0;
+    __atomic_fetch_add(&purgePasses, 1, __ATOMIC_RELAXED);
+    released += purgeIdleHeaps(now, dirtyMs, muzzyMs);
+
+    for (int i = 0; i < count; i++) {
+        Arena* arena = &globalArenas[i];
+        MemoryBlock* expired = NULL;
+
+        pthread_mutex_lock(&arena->lock);
+        MemoryBlock* current = arena->heap.freeHead;
+        while (current != NULL) {
+            MemoryBlock* next = current->next;
+            uint64_t idle = now - current->freeSince;
+            if ((current->pageState == PAGES_DIRTY && idle >= (uint64_t)dirtyMs) ||
+                (current->pageState == PAGES_MUZZY && idle >= (uint64_t)muzzyMs)) {
+                detachFree(&arena->heap, current);
+                current->next = expired;
+                expired = current;
+            }
+            current = next;
+        }
+        pthread_mutex_unlock(&arena->lock);
+
+        if (!expired) {
+            continue;
+        }
+        for (MemoryBlock* block = expired; block != NULL; block = block->next) {
+            released += purgeBlock(block, now, dirtyMs, muzzyMs);
+        }
+
+        pthread_mutex_lock(&arena->lock);
+        while (expired) {
+            MemoryBlock* next = expired->next;
+            insertFree(&arena->heap, expired);
+            expired = next;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    // Cached mappings nobody reused within the decay time go back to the kernel
+    pthread_mutex_lock(&largeLock);
+    for (int i = 0; i < MMAP_CACHE_SLOTS; i++) {
+        MemoryBlock* block = mmapCache[i];
+        if (block && now - block->freeSince >= (uint64_t)dirtyMs) {
+            munmap(block->start, block->length);
+            released += block->length;
+            mmapCacheBytes -= block->length;
+            block->start = NULL;
+            dropBlock(&largeHeap, block);
+            mmapCache[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&largeLock);
+
+    __atomic_fetch_add(&purgedBytes, released, __ATOMIC_RELAXED);
+}
+
+// Resident set of the whole process; read with plain syscalls since stdio may allocate
+static size_t residentBytes(void) {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+
+    char* end;
+    strtoul(buf, &end, 10);  // Total program size, skipped
+    return strtoul(end, NULL, 10) * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Sum the per-thread counters and walk the arenas. Threads keep running meanwhile, so the
+// snapshot is consistent per counter, not across counters.
+void LYMallocStats(LYStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    uint64_t pageBytes = 0;
+    pthread_mutex_lock(&heapListLock);
+    for (Heap* heap = allHeaps; heap != NULL; heap = heap->nextHeap) {
+        HeapStats* hs = &heap->stats;
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            stats->allocs[i] += STAT_LOAD(hs->allocs[i]);
+            stats->frees[i] += STAT_LOAD(hs->frees[i]);
+        }
+        stats->slowAllocs += STAT_LOAD(hs->slowAllocs);
+        stats->classRefills += STAT_LOAD(hs->classRefills);
+        stats->arenaRefills += STAT_LOAD(hs->arenaRefills);
+        stats->remoteNodeRefills += STAT_LOAD(hs->remoteNodeRefills);
+        stats->systemGrows += STAT_LOAD(hs->systemGrows);
+        stats->spills += STAT_LOAD(hs->spills);
+        stats->spilledBytes += STAT_LOAD(hs->spilledBytes);
+        stats->remoteFrees += STAT_LOAD(hs->remoteFrees);
+        stats->runBytes += STAT_LOAD(hs->runBytes);
+        stats->localFreeBytes += STAT_LOAD(heap->freeBytes);
+        pageBytes += STAT_LOAD(hs->pageBytes);
+        if (heap->orphaned) {
+            stats->orphanedHeaps++;
+        }
+        else {
+            stats->threads++;
+        }
+    }
+    pthread_mutex_unlock(&heapListLock);
+
+    uint64_t smallAllocs = 0;
+    for (int i = 1; i < NUM_SIZE_CLASSES; i++) {
+        uint64_t live = stats->allocs[i] > stats->frees[i] ? stats->allocs[i] - stats->frees[i] : 0;
+        stats->liveBytes[i] = live * classSizes[i];
+        stats->allocatedBytes += stats->liveBytes[i];
+        smallAllocs += stats->allocs[i];
+    }
+    stats->liveBytes[0] = (int64_t)pageBytes > 0 ? pageBytes : 0;
+    stats->allocatedBytes += stats->liveBytes[0];
+    stats->fastAllocs = smallAllocs > stats->slowAllocs ? smallAllocs - stats->slowAllocs : 0;
+
+    stats->arenas = getArenaCount();
+    stats->numaNodes = numaNodes;
+    for (int node = 0; node < numaNodes; node++) {
+        stats->nodeFirstArena[node] = nodeFirstArena[node];
+        stats->nodeArenas[node] = nodeArenas[node];
+    }
+    for (int i = 0; i < stats->arenas; i++) {
+        pthread_mutex_lock(&globalArenas[i].lock);
+        for (MemoryBlock* block = globalArenas[i].heap.freeHead; block != NULL; block = block->next) {
+            stats->arenaFreeBlocks++;
+            stats->arenaFreeBytes += block->length;
+            stats->nodeFreeBytes[arenaNode[i]] += block->length;
+            if (block->pageState == PAGES_PARTIAL) {
+                char* first;
+                stats->arenaPurgedBytes += hugeInterior(block, &first);
+            }
+            else if (block->pageState != PAGES_DIRTY) {
+                stats->arenaPurgedBytes += block->length;
+            }
+        }
+        pthread_mutex_unlock(&globalArenas[i].lock);
+    }
+
+    pthread_mutex_lock(&largeLock);
+    stats->largeAllocs = largeAllocs;
+    stats->largeFrees = largeFrees;
+    stats->largeCacheHits = largeCacheHits;
+    stats->largeBytes = largeLiveBytes;
+    stats->cachedBytes = mmapCacheBytes;
+    pthread_mutex_unlock(&largeLock);
+    stats->allocatedBytes += stats->largeBytes;
+
+    stats->purgePasses = __atomic_load_n(&purgePasses, __ATOMIC_RELAXED);
+    stats->purgedBytes = __atomic_load_n(&purgedBytes, __ATOMIC_RELAXED);
+    stats->mappedBytes = __atomic_load_n(&heapMappedBytes, __ATOMIC_RELAXED) +
+                         stats->largeBytes + stats->cachedBytes;
+    stats->metadataBytes = __atomic_load_n(&metaMappedBytes, __ATOMIC_RELAXED);
+    stats->residentBytes = residentBytes();
+    stats->fragmentation = stats->mappedBytes ?
+        1.0 - (double)stats->allocatedBytes / stats->mappedBytes : 0.0;
+}
+
+// Buffered output on a raw descriptor: stdio may allocate, and the dump must not sample itself
+typedef struct {
+    int fd;
+    int failed;
+    size_t used;
+    char data[4096];
+} ProfileWriter;
+
+static void profileFlush(ProfileWriter* w) {
+    size_t done = 0;
+    while (done < w->used && !w->failed) {
+        ssize_t n = write(w->fd, w->data + done, w->used - done);
+        if (n < 0 && errno != EINTR) {
+            w->failed = 1;
+        }
+        done += n > 0 ? (size_t)n : 0;
+    }
+    w->used = 0;
+}
+
+static void profilePrintf(ProfileWriter* w, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(w->data + w->used, sizeof(w->data) - w->used, format, args);
+    va_end(args);
+    if (n >= 0 && w->used + n >= sizeof(w->data)) {
+        profileFlush(w);
+        va_start(args, format);
+        n = vsnprintf(w->data, sizeof(w->data), format, args);
+        va_end(args);
+    }
+    if (n > 0) {
+        w->used += (size_t)n < sizeof(w->data) ? (size_t)n : sizeof(w->data) - 1;
+    }
+}
+
+// Legacy gperftools heap profile ("heap_v2"), which pprof unsamples using the rate in the
+// header. The mapped libraries at the end let pprof symbolize the raw return addresses.
+int LYMallocDumpProfile(const char* path) {
+    ProfileWriter w;
+    w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w.fd < 0) {
+        return -1;
+    }
+    w.failed = 0;
+    w.used = 0;
+
+    uint64_t inuseObjects = 0, inuseBytes = 0, allocObjects = 0, allocBytes = 0;
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        for (ProfileBucket* b = __atomic_load_n(&profileBuckets[i], __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+            uint64_t allocs = STAT_LOAD(b->allocs), bytes = STAT_LOAD(b->allocBytes);
+            inuseObjects += allocs - STAT_LOAD(b->frees);
+            inuseBytes += bytes - STAT_LOAD(b->freeBytes);
+            allocObjects += allocs;
+            allocBytes += bytes;
+        }
+    }
+    profilePrintf(&w, "heap profile: %6llu: %8llu [%6llu: %8llu] @ heap_v2/%zu\n",
+                  (unsigned long long)inuseObjects, (unsigned long long)inuseBytes,
+                  (unsigned long long)allocObjects, (unsigned long long)allocBytes,
+                  __atomic_load_n(&profileRate, __ATOMIC_RELAXED));
+
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        for (ProfileBucket* b = __atomic_load_n(&profileBuckets[i], __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+            uint64_t allocs = STAT_LOAD(b->allocs), bytes = STAT_LOAD(b->allocBytes);
+            profilePrintf(&w, "%6llu: %8llu [%6llu: %8llu] @",
+                          (unsigned long long)(allocs - STAT_LOAD(b->frees)),
+                          (unsigned long long)(bytes - STAT_LOAD(b->freeBytes)),
+                          (unsigned long long)allocs, (unsigned long long)bytes);
+            for (int j = 0; j < b->depth; j++) {
+                profilePrintf(&w, " 0x%016lx", (unsigned long)(uintptr_t)b->stack[j]);
+            }
+            profilePrintf(&w, "\n");
+        }
+    }
+
+    profilePrintf(&w, "\nMAPPED_LIBRARIES:\n");
+    profileFlush(&w);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t n;
+        while ((n = read(maps, w.data, sizeof(w.data))) > 0) {
+            w.used = (size_t)n;
+            profileFlush(&w);
+        }
+        close(maps);
+    }
+
+    int failed = w.failed;
+    if (close(w.fd) != 0) {
+        failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+void LYMallocStatsPrint(FILE* out) {
+    LYStats stats;
+    LYMallocStats(&stats);
+
+    uint64_t smallAllocs = stats.fastAllocs + stats.slowAllocs;
+    fprintf(out, "LYMalloc: %d threads, %d orphaned heaps, %d arenas on %d NUMA nodes\n",
+            stats.threads, stats.orphanedHeaps, stats.arenas, stats.numaNodes);
+    fprintf(out, "  allocated %zu, mapped %zu, resident %zu, metadata %zu, fragmentation %.3f\n",
+            stats.allocatedBytes, stats.mappedBytes, stats.residentBytes, stats.metadataBytes,
+            stats.fragmentation);
+    fprintf(out, "  small: %llu allocs, %.2f%% from the local free list, %llu runs (%zu bytes)\n",
+            (unsigned long long)smallAllocs,
+            smallAllocs ? 100.0 * stats.fastAllocs / smallAllocs : 0.0,
+            (unsigned long long)stats.classRefills, stats.runBytes);
+    fprintf(out, "  global: %llu arena refills (%llu from other nodes), %llu system grows, %llu spills (%llu bytes), %llu remote frees\n",
+            (unsigned long long)stats.arenaRefills, (unsigned long long)stats.remoteNodeRefills,
+            (unsigned long long)stats.systemGrows,
+            (unsigned long long)stats.spills, (unsigned long long)stats.spilledBytes,
+            (unsigned long long)stats.remoteFrees);
+    fprintf(out, "  free: %zu local, %zu in %zu arena blocks (%zu purged)\n",
+            stats.localFreeBytes, stats.arenaFreeBytes, stats.arenaFreeBlocks, stats.arenaPurgedBytes);
+    for (int i = 0; stats.numaNodes > 1 && i < stats.numaNodes; i++) {
+        fprintf(out, "  node %d: arenas %d-%d, %zu free in them\n", i, stats.nodeFirstArena[i],
+                stats.nodeFirstArena[i] + stats.nodeArenas[i] - 1, stats.nodeFreeBytes[i]);
+    }
+    fprintf(out, "  large: %llu allocs, %llu frees, %llu cache hits, %zu live, %zu cached\n",
+            (unsigned long long)stats.largeAllocs, (unsigned long long)stats.largeFrees,
+            (unsigned long long)stats.largeCacheHits, stats.largeBytes, stats.cachedBytes);
+    fprintf(out, "  purge: %llu passes, %llu bytes released\n",
+            (unsigned long long)stats.purgePasses, (unsigned long long)stats.purgedBytes);
+
+    fprintf(out, "  %5s %8s %12s %12s %12s\n", "class", "size", "allocs", "frees", "live bytes");
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        if (stats.allocs[i] == 0) {
+            continue;
+        }
+        if (i == 0) {
+            fprintf(out, "  %5s %8s", "page", "-");
+        }
+        else {
+            fprintf(out, "  %5d %8zu", i, classSizes[i]);
+        }
+        fprintf(out, " %12llu %12llu %12zu\n", (unsigned long long)stats.allocs[i],
+                (unsigned long long)stats.frees[i], stats.liveBytes[i]);
+    }
+}
+
+// Descriptors go back to the metadata pool for the next initMemoryAllocator()
+static void freeBlockList(MemoryBlock* block) {
     MemoryBlock *next_block;
+    pthread_mutex_lock(&metaLock);
     while (block != NULL) {
         next_block = block->next;
-        free(block);  // Free the structure
+        block->next = metaSpareBlocks;
+        metaSpareBlocks = block;
         block = next_block;
     }
+    pthread_mutex_unlock(&metaLock);
+}
 
-    // Free local heaps
-    #pragma omp parallel num_threads(num_threads)
-    {
-        //int thread_id = omp_get_thread_num();
-        MemoryBlock *local_block = localHeaps.freeHead;
-        MemoryBlock *local_next_block;
+// fork() handlers, so the child does not inherit a lock held by a thread it no longer has.
+// Locks are taken in the order the allocator nests them.
+void LYForkPrepare(void) {
+    pthread_mutex_lock(&heapListLock);
+    for (int i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_lock(&globalArenas[i].lock);
+    }
+    pthread_mutex_lock(&largeLock);
+    pthread_mutex_lock(&pageMapLock);
+    pthread_mutex_lock(&profileLock);
+    pthread_mutex_lock(&metaLock);
+}
+
+void LYForkParent(void) {
+    pthread_mutex_unlock(&metaLock);
+    pthread_mutex_unlock(&profileLock);
+    pthread_mutex_unlock(&pageMapLock);
+    pthread_mutex_unlock(&largeLock);
+    for (int i = MAX_ARENAS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&globalArenas[i].lock);
+    }
+    pthread_mutex_unlock(&heapListLock);
+}
 
-        // Free all blocks in the local freeHead list
-        while (local_block != NULL) {
-            local_next_block = local_block->next;
-            free(local_block);  // Free the structure
-            local_block = local_next_block;
+void LYForkChild(void) {
+    // The reclaim thread did not survive the fork, and neither did the owners of the other heaps
+    __atomic_store_n(&reclaimThreadStarted, 0, __ATOMIC_RELAXED);
+    for (Heap* heap = allHeaps; heap != NULL; heap = heap->nextHeap) {
+        if (heap != LYLocalHeap && !heap->orphaned) {
+            orphanHeap(heap);
         }
+        if (heap != LYLocalHeap) {
+            pthread_mutex_init(&heap->pageLock, NULL);  // Its owner may have held it
+        }
+    }
+    LYForkParent();
+}
 
-        local_block = localHeaps.usedHead;
-        // Additionally free all blocks in the local usedHead list if not already done
-        while (local_block != NULL) {
-            local_next_block = local_block->next;
-            free(local_block);  // Free the structure
-            local_block = local_next_block;
+void freeMemoryAllocator(int num_threads) {
+    // Stop the background thread first
+    keep_running = 0;  // Assuming keep_running is a global volatile int used to control the reclaim thread
+    if (__atomic_load_n(&reclaimThreadStarted, __ATOMIC_RELAXED)) {
+        pthread_join(reclaim_thread, NULL);  // Wait for the reclaim thread to finish
+        __atomic_store_n(&reclaimThreadStarted, 0, __ATOMIC_RELAXED);
+    }
+
+    // Free the global arenas
+    for (int i = 0; i < MAX_ARENAS; i++) {
+        Arena* arena = &globalArenas[i];
+        pthread_mutex_lock(&arena->lock);
+        freeBlockList(arena->heap.freeHead);
+        freeBlockList(arena->heap.spareBlocks);
+        arena->heap.freeHead = NULL;
+        arena->heap.spareBlocks = NULL;
+        arena->heap.spareCount = 0;
+        arena->heap.freeBytes = 0;
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    // Unmap the large-object tier, cached mappings included
+    pthread_mutex_lock(&largeLock);
+    for (int i = 0; i < MMAP_CACHE_SLOTS; i++) {
+        if (mmapCache[i]) {
+            munmap(mmapCache[i]->start, mmapCache[i]->length);
+            freeBlockList(mmapCache[i]);
+            mmapCache[i] = NULL;
         }
     }
+    mmapCacheBytes = 0;
+    largeLiveBytes = 0;
+    largeAllocs = 0;
+    largeFrees = 0;
+    largeCacheHits = 0;
+    for (MemoryBlock* block = largeHeap.usedHead; block != NULL; block = block->next) {
+        munmap(block->start, block->length);
+    }
+    freeBlockList(largeHeap.usedHead);
+    freeBlockList(largeHeap.spareBlocks);
+    largeHeap.usedHead = NULL;
+    largeHeap.spareBlocks = NULL;
+    largeHeap.spareCount = 0;
+    pthread_mutex_unlock(&largeLock);
+
+    // Reset every local heap; threads keep their Heap and start over empty
+    pthread_mutex_lock(&heapListLock);
+    for (Heap* heap = allHeaps; heap != NULL; heap = heap->nextHeap) {
+        freeBlockList(heap->freeHead);
+        freeBlockList(heap->usedHead);
+        freeBlockList(heap->spareBlocks);
+        heap->freeHead = NULL;
+        heap->usedHead = NULL;
+        heap->spareBlocks = NULL;
+        heap->spareCount = 0;
+        heap->freeBytes = 0;
+        heap->refillSize = 0;
+        heap->remoteFree = NULL;
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            freeBlockList(heap->classRuns[i]);
+            heap->classFree[i] = NULL;
+            heap->classCount[i] = 0;
+            heap->classRuns[i] = NULL;
+        }
+        // Counters and idle tracking start over with the heap
+        memset(&heap->stats, 0, sizeof(heap->stats));
+        heap->idleOps = 0;
+        heap->idleSince = 0;
+    }
+    pthread_mutex_unlock(&heapListLock);
+
+    pageMapClear();
+
+    // Nothing points into the heap chunks any more; unmap them and keep the records
+    pthread_mutex_lock(&metaLock);
+    while (systemChunks) {
+        SystemChunk* chunk = systemChunks;
+        systemChunks = chunk->next;
+        munmap(chunk->start, chunk->length);
+        chunk->next = spareChunks;
+        spareChunks = chunk;
+    }
+    pthread_mutex_unlock(&metaLock);
+    __atomic_store_n(&heapMappedBytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&purgedBytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&purgePasses, 0, __ATOMIC_RELAXED);
 }
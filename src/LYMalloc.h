@@ -4,38 +4,250 @@
 #include <stdio.h>
 #include <omp.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
 
 #define HEAP_SIZE 1024 * 1024  // Assuming 1MB of local heap per thread
-#define ALIGN 63
+#define MIN_ALIGNMENT 16  // Every size class is a multiple of this
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)  // Blocks above MAX_SMALL_SIZE are rounded to whole pages
+#define PAGEMAP_BITS 12  // Bits of the page number resolved per page map level (3 levels, 48-bit addresses)
+#define PAGEMAP_MASK ((1UL << PAGEMAP_BITS) - 1)
 #define SIZE 256
 #define GSIZE 1024
 
+// Page state of a free block, ordered from least to most resident
+#define PAGES_CLEAN 0  // Never touched or purged with MADV_DONTNEED, reads as zero
+#define PAGES_MUZZY 1  // Handed to the kernel with MADV_FREE
+#define PAGES_PARTIAL 2  // Huge page mode: aligned interior purged, ragged edges possibly resident
+#define PAGES_DIRTY 3  // Possibly resident
+
+// Size classes: 16-byte steps up to 128 B, then four classes per power of two up to 32 KB.
+// Class 0 is reserved for blocks that are not served from a size class.
+#define NUM_SIZE_CLASSES 41
+#define MAX_SMALL_SIZE (32 * 1024)
+#define RUN_SIZE (16 * 1024)  // Bytes carved from a heap when a size class runs empty
+#define MAX_RUN_OBJECTS 256
+#define RUN_MAP_WORDS (MAX_RUN_OBJECTS / 64)  // Free bitmap of a run, one bit per slot
+#define LOCAL_REFILL_MIN (64 * 1024)  // First chunk a thread pulls from the global heap
+#define LOCAL_REFILL_MAX (4 * HEAP_SIZE)  // Refills of a busy thread double up to this
+#define GLOBAL_GROW_SIZE (4 * HEAP_SIZE)  // Smallest chunk requested from the system when the arenas run dry
+#define MMAP_THRESHOLD HEAP_SIZE  // Default size from which requests get their own mapping
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)  // Transparent huge page, see LYSetHugePages()
+#define MMAP_CACHE_SLOTS 8  // Recently freed mappings kept to avoid mmap/munmap storms
+#define MMAP_CACHE_BYTES (64 * HEAP_SIZE)
+#define DIRTY_DECAY_MS 10000  // Idle time before free arena pages are purged
+#define MUZZY_DECAY_MS 0  // Extra MADV_FREE stage before MADV_DONTNEED, 0 skips it
+#define DECAY_STEPS 10  // Purge passes per decay period
+#define MAX_ARENAS 64  // Upper bound on global arenas, one per CPU
+#define MAX_NUMA_NODES 64  // Nodes the arenas are grouped by, see LYSetNumaTopology()
+#define MAX_CPUS 4096  // CPUs mapped to their node; higher ones count as node 0
+#define NUMA_REMOTE_MIN (16 * HEAP_SIZE)  // Free bytes another node's arena needs before a refill crosses nodes
+#define META_CHUNK_SIZE (64 * 1024)  // Mapping size for heaps and block descriptors
+#define ARENA_CHUNK_SIZE (64 * 1024)  // Default chunk size of an LYArena
+#define PROFILE_MAX_DEPTH 32  // Frames kept per sampled allocation
+#define PROFILE_BUCKETS 4096  // Hash chains of distinct sampled stacks
+#define PROFILE_RECHECK_BYTES (16 * HEAP_SIZE)  // Bytes between checks while sampling is off
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+// Descriptors are carved in page-sized slabs per heap (see newBlock()). The first 32 bytes
+// hold everything LYFree reads, and the alignment keeps them inside one cache line.
 typedef struct MemoryBlock {
     void* start;
+    struct Heap* owner;  // Local heap the block was handed out from, NULL while free
+    int sizeClass;  // Non-zero when the block is a run split into objects of that class
+    int mapped;  // Non-zero for a dedicated mapping of the large-object tier
+    struct ProfileBucket* sample;  // Stack of a sampled allocation, NULL otherwise
     size_t length;
     struct MemoryBlock* next;
-} MemoryBlock;
+    struct MemoryBlock* prev;
+    struct Heap* freeHeap;  // Heap whose free list holds the block, NULL while in use
+    int pageState;  // PAGES_CLEAN, PAGES_MUZZY or PAGES_DIRTY
+    uint64_t freeSince;  // Milliseconds (monotonic) when the pages last became free
+    size_t sampleSize;  // Requested size of the sampled allocation
+    uint32_t slots;  // Objects in a run
+    uint32_t freeSlots;  // Bits set in freeMap
+    uint64_t freeMap[RUN_MAP_WORDS];  // Run slots not held by any thread's class cache
+} __attribute__((aligned(32))) MemoryBlock;
 
+// Counters in HeapStats have a single writer, so a relaxed store is enough for
+// LYMallocStats() to read them from another thread without any locked instruction
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STAT_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Per-thread counters. Only the owning thread writes them, LYMallocStats() sums them up.
+// Their own cache line keeps them away from remoteFree, which other threads write.
 typedef struct {
+    uint64_t allocs[NUM_SIZE_CLASSES];  // Class 0 counts page blocks
+    uint64_t frees[NUM_SIZE_CLASSES];  // Counted by the owner, remote frees once drained
+    uint64_t slowAllocs;  // Class free list was empty
+    uint64_t classRefills;  // Runs carved for a class
+    uint64_t arenaRefills;  // Chunks pulled from a global arena
+    uint64_t remoteNodeRefills;  // Of those, from an arena on another NUMA node
+    uint64_t systemGrows;  // Chunks mapped because the arenas were dry
+    uint64_t spills;  // Surplus handed back to the arenas
+    uint64_t spilledBytes;
+    uint64_t remoteFrees;  // Objects other threads freed into this heap
+    uint64_t pageBytes;  // Bytes in live page blocks
+    uint64_t runBytes;  // Bytes carved into runs
+} __attribute__((aligned(CACHE_LINE_SIZE))) HeapStats;
+
+typedef struct Heap {
+    int64_t sampleCountdown;  // Bytes until the next profile sample, see LYSetProfileRate()
     MemoryBlock* freeHead;
     MemoryBlock* usedHead;
+    void* classFree[NUM_SIZE_CLASSES];  // Class cache: free objects linked through their first word
+    uint32_t classCount[NUM_SIZE_CLASSES];  // Objects on classFree
+    uint32_t classLimit[NUM_SIZE_CLASSES];  // Above this the coldest half goes back to the runs
+    MemoryBlock* classRuns[NUM_SIZE_CLASSES];  // Runs with free slots; full runs sit on usedHead
+    void* remoteFree;  // Lock-free stack of pointers freed by other threads, drained by the owner
+    size_t freeBytes;  // Bytes on freeHead
+    size_t refillSize;  // Next chunk pulled from the global heap, 0 until the first refill
+    MemoryBlock* spareBlocks;  // Recycled descriptors
+    size_t spareCount;  // Descriptors on spareBlocks
+    struct Heap* nextHeap;  // Registry of every thread heap
+    struct Heap* nextOrphan;  // Orphan list, see releaseLocalHeap()
+    int orphaned;  // Owner thread exited, waiting for a new thread to adopt the heap
+    uint64_t sampleSeed;  // Random state behind the sampling intervals
+    int sampling;  // Set while a sample is taken, nested allocations are not sampled
+    pthread_mutex_t pageLock;  // Guards freeHead against the decay pass, see purgeIdleHeaps()
+    uint64_t idleOps;  // Allocations plus frees at the last decay pass, see purgeIdleHeaps()
+    uint64_t idleSince;  // Milliseconds (monotonic) since idleOps last changed
+    HeapStats stats;
 } Heap;
 
+// One shard of the global tier; padded so neighbouring locks do not share a cache line
+typedef struct {
+    pthread_mutex_t lock;
+    Heap heap;
+} __attribute__((aligned(CACHE_LINE_SIZE))) Arena;
+
+// Snapshot filled in by LYMallocStats()
+typedef struct {
+    uint64_t allocs[NUM_SIZE_CLASSES];  // Per size class, class 0 for page blocks
+    uint64_t frees[NUM_SIZE_CLASSES];
+    size_t liveBytes[NUM_SIZE_CLASSES];
+    uint64_t fastAllocs;  // Served straight from the thread's class free list
+    uint64_t slowAllocs;
+    uint64_t classRefills;
+    uint64_t arenaRefills;
+    uint64_t remoteNodeRefills;
+    uint64_t systemGrows;
+    uint64_t spills;
+    uint64_t spilledBytes;
+    uint64_t remoteFrees;
+    uint64_t largeAllocs;  // Dedicated mappings
+    uint64_t largeFrees;
+    uint64_t largeCacheHits;
+    uint64_t purgePasses;  // reclaimMemory() runs
+    uint64_t purgedBytes;  // Bytes released with madvise or munmap
+    size_t allocatedBytes;  // Live objects, rounded to their class or page size
+    size_t runBytes;  // Carved into runs, free objects included
+    size_t largeBytes;  // Live dedicated mappings
+    size_t localFreeBytes;  // Free lists of the thread heaps
+    size_t arenaFreeBytes;  // Free lists of the arenas
+    size_t arenaFreeBlocks;
+    size_t arenaPurgedBytes;  // Part of arenaFreeBytes already given back to the kernel
+    size_t nodeFreeBytes[MAX_NUMA_NODES];  // arenaFreeBytes split by the NUMA node of the arena
+    int nodeFirstArena[MAX_NUMA_NODES];  // A node's arenas are nodeArenas in a row from here
+    int nodeArenas[MAX_NUMA_NODES];
+    size_t cachedBytes;  // Freed mappings kept in the mmap cache
+    size_t mappedBytes;  // Everything mapped for objects: heaps, arenas, large tier
+    size_t metadataBytes;  // Descriptors, heaps and page map nodes
+    size_t residentBytes;  // Process resident set, from /proc/self/statm
+    double fragmentation;  // 1 - allocatedBytes / mappedBytes
+    int threads;  // Heaps in use by a live thread
+    int orphanedHeaps;
+    int arenas;
+    int numaNodes;
+} LYStats;
+
+// Region allocator, see LYArenaCreate()
+typedef struct LYArena LYArena;
+
+// Heap of the calling thread, NULL until its first allocation
+extern _Thread_local Heap* LYLocalHeap __attribute__((tls_model("initial-exec")));
 
 void initHeap(Heap* heap, void* start, size_t length);
 void* reclaimRoutine(void* arg);
 void initMemoryAllocator(int threadCount);
 void addToHeap(MemoryBlock** head, MemoryBlock* newBlock);
+void removeFromHeap(MemoryBlock** head, MemoryBlock* block);
+MemoryBlock* pageMapGet(const void* addr);
 MemoryBlock* findAndDetachBlock(Heap* heap, size_t len);
 MemoryBlock* findBlock(Heap* heap, size_t len);
+size_t classToSize(int sizeClass);
 void* LYMalloc(size_t size);
+void LYSetMmapThreshold(size_t bytes);
+void LYSetHugePages(int enable);
+void LYSetNumaTopology(const char* nodes);
+void LYSetThreadNode(int node);
+void* LYAlignedAlloc(size_t alignment, size_t size);
+int LYPosixMemalign(void** memptr, size_t alignment, size_t size);
+void* LYCalloc(size_t count, size_t size);
+void* LYRealloc(void* ptr, size_t size);
+size_t LYUsableSize(void* ptr);
 void LYFree(void* ptr);
-void reclaimMemory(int num_threads);
+size_t LYMallocBatch(size_t size, size_t count, void** out);
+void LYFreeBatch(void** ptrs, size_t count);
+void LYFreeSized(void* ptr, size_t size);
+LYArena* LYArenaCreate(size_t chunkSize);
+void* LYArenaAlloc(LYArena* arena, size_t size);
+void LYArenaReset(LYArena* arena);
+void LYArenaDestroy(LYArena* arena);
+void reclaimMemory(void);
+void LYSetDecayTime(long dirtyMs, long muzzyMs);
+void LYMallocStats(LYStats* stats);
+void LYMallocStatsPrint(FILE* out);
+void LYSetProfileRate(size_t meanBytes);
+int LYMallocDumpProfile(const char* path);
+void LYForkPrepare(void);
+void LYForkParent(void);
+void LYForkChild(void);
 void freeMemoryAllocator(int num_threads);
 
+// Inline so a constant size folds to its class at compile time
+static inline int sizeToClass(size_t size) {
+    if (size <= 128) {
+        return size == 0 ? 1 : (int)((size + 15) >> 4);
+    }
+
+    // Above 128 B every power of two is split into four equally spaced classes
+    size_t s = size - 1;
+    int msb = 63 - __builtin_clzl(s);
+    return 8 + (msb - 7) * 4 + (int)((s >> (msb - 2)) & 3) + 1;
+}
+
+// The pop of LYMalloc() for a small size whose class is already known. Anything else (no
+// heap yet, an empty class cache, a profile sample due) takes the out-of-line LYMalloc().
+static inline void* LYMallocSmall(size_t size, int sizeClass) {
+    Heap* heap = LYLocalHeap;
+    if (__builtin_expect(heap != NULL, 1)) {
+        void* obj = heap->classFree[sizeClass];
+        if (__builtin_expect(obj != NULL && heap->sampleCountdown >= (int64_t)size, 1)) {
+            heap->sampleCountdown -= (int64_t)size;
+            heap->classFree[sizeClass] = *(void**)obj;
+            heap->classCount[sizeClass]--;
+            STAT_ADD(heap->stats.allocs[sizeClass], 1);
+            return obj;
+        }
+    }
+    return LYMalloc(size);
+}
+
+// LYMalloc() for a size known at compile time, e.g. LY_MALLOC_CONST(sizeof(struct node)).
+// A small constant resolves its class while compiling and pops inline; other sizes, and
+// builds without optimization, fall back to the LYMalloc() call.
+#define LY_MALLOC_CONST(size) \
+    ((__builtin_constant_p(size) && (size) <= MAX_SMALL_SIZE) ? \
+        LYMallocSmall((size), sizeToClass(size)) : LYMalloc(size))
+
 #endif
\ No newline at end of file
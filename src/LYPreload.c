@@ -0,0 +1,215 @@
+/*
+ * Summary:
+ * Drop-in replacement for the C allocation interface, built as liblymalloc.so:
+ *
+ *     LD_PRELOAD=./liblymalloc.so sqlite3 test.db
+ *
+ * Every entry point forwards to LYMalloc. No init call is needed: heaps, arenas and the
+ * page map are created on first use and the allocator's metadata never comes from libc.
+ * No background thread is started; threads that free memory run the decay pass instead.
+ *
+ * Tunables are read from the environment at load time:
+ * - LYMALLOC_DIRTY_DECAY_MS, LYMALLOC_MUZZY_DECAY_MS (see LYSetDecayTime)
+ * - LYMALLOC_MMAP_THRESHOLD (see LYSetMmapThreshold)
+ * - LYMALLOC_HUGEPAGES=1 maps 2 MB-aligned segments backed by huge pages (see LYSetHugePages)
+ * - LYMALLOC_NUMA_TOPOLOGY="0-3;4-7" simulates NUMA nodes (see LYSetNumaTopology)
+ * - LYMALLOC_STATS=1 prints LYMallocStatsPrint() to stderr at exit
+ * - LYMALLOC_PROF_RATE samples one allocation per that many bytes (see LYSetProfileRate)
+ * - LYMALLOC_PROF_DUMP writes the heap profile to that path at exit (see LYMallocDumpProfile)
+ * - LYMALLOC_TRACE records every call to that path for the replay tool (see LYTrace.h)
+ *
+ * Child processes inherit the environment. The process that first loads the library (or
+ * whatever it execs, which keeps its pid) writes to the paths given; every other process,
+ * forked or exec'd, appends .<pid>, so a child never truncates a file its parent still
+ * writes. A forked child that does not exec stops tracing. To tell them apart the first
+ * process sets LYMALLOC_PID to its pid, the only variable the library adds to the
+ * environment; unset it to start over as a new first process.
+ */
+
+#define _GNU_SOURCE
+#include "LYMalloc.h"
+#include "LYTrace.h"
+#include <errno.h>
+#include <malloc.h>
+
+// Set once the trace file is open, so recording costs one predictable branch when off
+static int tracing;
+static int ownsPaths;  // First process to load the library, see processPath()
+
+#define TRACE(op, object, previous, size, alignment) \
+    do { \
+        if (__builtin_expect(tracing, 0)) { \
+            LYTraceRecord(op, object, previous, size, alignment); \
+        } \
+    } while (0)
+
+static long readTunable(const char* name, long fallback) {
+    const char* value = getenv(name);
+    if (!value || !*value) {
+        return fallback;
+    }
+    char* end;
+    long parsed = strtol(value, &end, 10);
+    return *end == '\0' ? parsed : fallback;
+}
+
+// path for the first process, path.<pid> for its children
+static const char* processPath(const char* path, char* buffer, size_t size) {
+    if (ownsPaths) {
+        return path;
+    }
+    snprintf(buffer, size, "%s.%ld", path, (long)getpid());
+    return buffer;
+}
+
+// A forked child keeps allocating but must not write into the parent's trace, and its
+// profile and statistics go to its own path
+static void preloadForkChild(void) {
+    LYForkChild();
+    ownsPaths = 0;
+    if (tracing) {
+        tracing = 0;
+        LYTraceStop();
+    }
+}
+
+__attribute__((constructor))
+static void preloadInit(void) {
+    char pid[24];
+    snprintf(pid, sizeof(pid), "%ld", (long)getpid());
+    const char* owner = getenv("LYMALLOC_PID");
+    ownsPaths = !owner || strcmp(owner, pid) == 0;
+    if (!owner) {
+        setenv("LYMALLOC_PID", pid, 0);
+    }
+
+    LYSetDecayTime(readTunable("LYMALLOC_DIRTY_DECAY_MS", DIRTY_DECAY_MS),
+                   readTunable("LYMALLOC_MUZZY_DECAY_MS", MUZZY_DECAY_MS));
+    long threshold = readTunable("LYMALLOC_MMAP_THRESHOLD", 0);
+    if (threshold > 0) {
+        LYSetMmapThreshold((size_t)threshold);
+    }
+    if (readTunable("LYMALLOC_HUGEPAGES", 0) > 0) {
+        LYSetHugePages(1);
+    }
+    const char* topology = getenv("LYMALLOC_NUMA_TOPOLOGY");
+    if (topology && *topology) {
+        LYSetNumaTopology(topology);
+    }
+    long rate = readTunable("LYMALLOC_PROF_RATE", 0);
+    if (rate > 0) {
+        LYSetProfileRate((size_t)rate);
+    }
+    const char* trace = getenv("LYMALLOC_TRACE");
+    char tracePath[4096];
+    if (trace && *trace && LYTraceOpen(processPath(trace, tracePath, sizeof(tracePath))) == 0) {
+        tracing = 1;
+    }
+    pthread_atfork(LYForkPrepare, LYForkParent, preloadForkChild);
+}
+
+__attribute__((destructor))
+static void preloadFini(void) {
+    if (tracing) {
+        tracing = 0;
+        LYTraceClose();
+    }
+    if (readTunable("LYMALLOC_STATS", 0) > 0) {
+        if (!ownsPaths) {
+            fprintf(stderr, "LYMalloc: child process %ld\n", (long)getpid());
+        }
+        LYMallocStatsPrint(stderr);
+    }
+    const char* profile = getenv("LYMALLOC_PROF_DUMP");
+    char profilePath[4096];
+    if (profile && *profile) {
+        LYMallocDumpProfile(processPath(profile, profilePath, sizeof(profilePath)));
+    }
+}
+
+// Allocations are traced after the call and frees before it, see LYTrace.c
+void* malloc(size_t size) {
+    void* ptr = LYMalloc(size);
+    if (!ptr) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    TRACE(TRACE_MALLOC, ptr, NULL, size, 0);
+    return ptr;
+}
+
+void free(void* ptr) {
+    if (ptr) {
+        TRACE(TRACE_FREE, ptr, NULL, 0, 0);
+    }
+    LYFree(ptr);
+}
+
+void* calloc(size_t count, size_t size) {
+    void* ptr = LYCalloc(count, size);
+    if (!ptr) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    TRACE(TRACE_CALLOC, ptr, NULL, count * size, 0);
+    return ptr;
+}
+
+// LYRealloc() may free ptr, so the slot is taken before the call, like a free's record
+void* realloc(void* ptr, size_t size) {
+    uint64_t slot = TRACE_NO_SLOT;
+    if (ptr && size == 0) {
+        TRACE(TRACE_FREE, ptr, NULL, 0, 0);
+    }
+    else if (__builtin_expect(tracing, 0)) {
+        slot = LYTraceReserve();
+    }
+    void* newPtr = LYRealloc(ptr, size);
+    if (!newPtr) {
+        if (ptr == NULL || size != 0) {
+            errno = ENOMEM;
+        }
+        return NULL;
+    }
+    if (slot != TRACE_NO_SLOT) {
+        LYTraceFill(slot, TRACE_REALLOC, newPtr, ptr, size, 0);
+    }
+    return newPtr;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    int result = LYPosixMemalign(memptr, alignment, size);
+    if (result == 0) {
+        TRACE(TRACE_ALIGNED, *memptr, NULL, size, alignment);
+    }
+    return result;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    void* ptr = LYAlignedAlloc(alignment, size);
+    if (!ptr) {
+        if (alignment != 0 && (alignment & (alignment - 1)) == 0) {
+            errno = ENOMEM;
+        }
+        return NULL;
+    }
+    TRACE(TRACE_ALIGNED, ptr, NULL, size, alignment);
+    return ptr;
+}
+
+// Obsolete interfaces, still overridden so no pointer from glibc's heap reaches LYFree
+void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return aligned_alloc(PAGE_SIZE, size);
+}
+
+void* pvalloc(size_t size) {
+    return aligned_alloc(PAGE_SIZE, (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return LYUsableSize(ptr);
+}
@@ -0,0 +1,150 @@
+/*
+ * Allocation trace recorder used by liblymalloc.so. Records go straight into a shared file
+ * mapping that grows a chunk at a time, so recording never allocates and never calls into
+ * stdio. A thread reserves a slot with one atomic add and fills it in place.
+ *
+ * Callers record allocations after the call returns and frees before the call, so the
+ * object's address cannot be handed out again before its free is in the trace. A realloc
+ * does both at once: its slot is reserved before the call and filled in after it.
+ */
+
+#define _GNU_SOURCE
+#include "LYTrace.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_CHUNK_BYTES ((size_t)TRACE_CHUNK_RECORDS * sizeof(TraceRecord))
+
+static int traceFd = -1;
+static int traceActive;
+static uint64_t traceStart;
+static uint64_t traceNext;  // Next slot to hand out
+static uint64_t traceDropped;
+static uint32_t traceThreads;
+static off_t traceSize;
+static TraceRecord* traceChunks[TRACE_MAX_CHUNKS];
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;  // Guards growing the file
+static _Thread_local uint32_t traceThread __attribute__((tls_model("initial-exec")));
+
+static uint64_t traceNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void traceWriteHeader(void) {
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.recordSize = sizeof(TraceRecord);
+    uint64_t records = __atomic_load_n(&traceNext, __ATOMIC_RELAXED);
+    uint64_t capacity = (uint64_t)TRACE_CHUNK_RECORDS * TRACE_MAX_CHUNKS;
+    header.records = records < capacity ? records : capacity;
+    header.dropped = __atomic_load_n(&traceDropped, __ATOMIC_RELAXED);
+    pwrite(traceFd, &header, sizeof(header), 0);
+}
+
+int LYTraceOpen(const char* path) {
+    traceFd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (traceFd < 0) {
+        return -1;
+    }
+    traceSize = TRACE_HEADER_SIZE;
+    if (ftruncate(traceFd, traceSize) != 0) {
+        close(traceFd);
+        traceFd = -1;
+        return -1;
+    }
+    traceWriteHeader();
+    traceStart = traceNow();
+    __atomic_store_n(&traceActive, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Map the chunk holding a slot, growing the file first. Chunks stay mapped until exit.
+static TraceRecord* traceChunk(size_t index) {
+    TraceRecord* chunk = __atomic_load_n(&traceChunks[index], __ATOMIC_ACQUIRE);
+    if (chunk) {
+        return chunk;
+    }
+
+    pthread_mutex_lock(&traceLock);
+    chunk = traceChunks[index];
+    off_t offset = TRACE_HEADER_SIZE + (off_t)index * TRACE_CHUNK_BYTES;
+    if (!chunk && (offset + (off_t)TRACE_CHUNK_BYTES <= traceSize ||
+                   ftruncate(traceFd, offset + TRACE_CHUNK_BYTES) == 0)) {
+        if (offset + (off_t)TRACE_CHUNK_BYTES > traceSize) {
+            traceSize = offset + TRACE_CHUNK_BYTES;
+        }
+        void* memory = mmap(NULL, TRACE_CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, traceFd, offset);
+        if (memory != MAP_FAILED) {
+            chunk = (TraceRecord*)memory;
+            __atomic_store_n(&traceChunks[index], chunk, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&traceLock);
+    return chunk;
+}
+
+uint64_t LYTraceReserve(void) {
+    if (!__atomic_load_n(&traceActive, __ATOMIC_ACQUIRE)) {
+        return TRACE_NO_SLOT;
+    }
+    return __atomic_fetch_add(&traceNext, 1, __ATOMIC_RELAXED);
+}
+
+// A reserved slot that is never filled stays TRACE_NONE, which the replay skips
+void LYTraceFill(uint64_t slot, int op, void* object, void* previous, size_t size, size_t alignment) {
+    if (slot == TRACE_NO_SLOT || !__atomic_load_n(&traceActive, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    size_t index = slot / TRACE_CHUNK_RECORDS;
+    TraceRecord* chunk = index < TRACE_MAX_CHUNKS ? traceChunk(index) : NULL;
+    if (!chunk) {
+        __atomic_fetch_add(&traceDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (traceThread == 0) {
+        traceThread = __atomic_add_fetch(&traceThreads, 1, __ATOMIC_RELAXED);
+    }
+
+    TraceRecord* record = &chunk[slot % TRACE_CHUNK_RECORDS];
+    record->time = traceNow() - traceStart;
+    record->object = (uintptr_t)object;
+    record->previous = (uintptr_t)previous;
+    record->size = size;
+    record->thread = traceThread;
+    record->alignShift = alignment > 1 ? (uint8_t)(63 - __builtin_clzll(alignment)) : 0;
+    record->reserved = 0;
+    record->op = (uint8_t)op;
+}
+
+void LYTraceRecord(int op, void* object, void* previous, size_t size, size_t alignment) {
+    LYTraceFill(LYTraceReserve(), op, object, previous, size, alignment);
+}
+
+// Stop recording and let go of the file without touching it; used in a forked child,
+// which must not write into the parent's trace
+void LYTraceStop(void) {
+    __atomic_store_n(&traceActive, 0, __ATOMIC_RELEASE);
+    traceFd = -1;
+}
+
+// Threads may still be inside LYTraceRecord() at exit, so the chunks stay mapped and the
+// file keeps its chunk-rounded size; the header says how many slots were handed out.
+void LYTraceClose(void) {
+    if (traceFd < 0) {
+        return;
+    }
+    __atomic_store_n(&traceActive, 0, __ATOMIC_RELEASE);
+    traceWriteHeader();
+    close(traceFd);
+    traceFd = -1;
+}
@@ -0,0 +1,52 @@
+#ifndef LYTRACE_H
+#define LYTRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Allocation trace file: a TraceHeader padded to TRACE_HEADER_SIZE, then TraceRecords in the
+// order their operations were observed. Written by liblymalloc.so (LYMALLOC_TRACE=path),
+// read by the replay tool.
+#define TRACE_MAGIC "LYTRACE1"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 4096  // Records start on a page so the file can be mapped in chunks
+#define TRACE_CHUNK_RECORDS (512 * 800)  // Records per mapping; 512 records span a whole number of pages
+#define TRACE_MAX_CHUNKS 4096
+#define TRACE_NO_SLOT UINT64_MAX  // LYTraceReserve() while not recording
+
+enum {
+    TRACE_NONE = 0,  // Reserved slot that was never written (dropped or cut off at exit)
+    TRACE_MALLOC,
+    TRACE_CALLOC,
+    TRACE_ALIGNED,
+    TRACE_REALLOC,
+    TRACE_FREE
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t records;  // Slots in use, TRACE_NONE ones included
+    uint64_t dropped;  // Operations lost because the file could not grow
+} TraceHeader;
+
+typedef struct {
+    uint64_t time;  // Nanoseconds since recording started
+    uint64_t object;  // Address returned, or freed for TRACE_FREE
+    uint64_t previous;  // Address passed to realloc
+    uint64_t size;
+    uint32_t thread;  // Dense id, 1 for the first thread seen
+    uint8_t op;
+    uint8_t alignShift;  // log2 of the alignment for TRACE_ALIGNED
+    uint16_t reserved;
+} TraceRecord;
+
+int LYTraceOpen(const char* path);
+void LYTraceRecord(int op, void* object, void* previous, size_t size, size_t alignment);
+uint64_t LYTraceReserve(void);
+void LYTraceFill(uint64_t slot, int op, void* object, void* previous, size_t size, size_t alignment);
+void LYTraceStop(void);
+void LYTraceClose(void);
+
+#endif
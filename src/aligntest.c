@@ -0,0 +1,47 @@
+/*
+ * LYAlignedAlloc() edge cases. Run with `make test`; exits non-zero if a check fails.
+ */
+
+#include "LYMalloc.h"
+
+static int failures;
+
+static void check(int ok, const char* what) {
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok) {
+        failures++;
+    }
+}
+
+// A zero size block at an alignment above a page must still own the page it starts on
+static void zeroSize(size_t alignment, const char* name) {
+    char what[128];
+    LYStats before, after;
+
+    LYMallocStats(&before);
+    char* ptr = LYAlignedAlloc(alignment, 0);
+    MemoryBlock* block = ptr ? pageMapGet(ptr) : NULL;
+
+    snprintf(what, sizeof(what), "%s: aligned block of size 0", name);
+    check(ptr && ((uintptr_t)ptr & (alignment - 1)) == 0, what);
+    snprintf(what, sizeof(what), "%s: page map resolves the block itself", name);
+    check(block && block->start == ptr, what);
+    snprintf(what, sizeof(what), "%s: page before the block is left alone", name);
+    check(pageMapGet(ptr - 1) != block, what);
+    snprintf(what, sizeof(what), "%s: usable size is one page", name);
+    check(LYUsableSize(ptr) == PAGE_SIZE, what);
+
+    LYFree(ptr);
+    LYMallocStats(&after);
+    snprintf(what, sizeof(what), "%s: free gives the block back", name);
+    check(after.allocatedBytes == before.allocatedBytes && after.largeBytes == before.largeBytes, what);
+}
+
+int main(void) {
+    void* warm = LYMalloc(1);  // Sets up the thread heap before the first snapshot
+    zeroSize(8192, "8 KB alignment");
+    zeroSize(1 << 20, "1 MB alignment");
+    LYFree(warm);
+
+    return failures ? 1 : 0;
+}
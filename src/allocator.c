@@ -0,0 +1,67 @@
+/*
+ * Allocators the benchmark suite can run against. System malloc and LYMalloc are linked in;
+ * jemalloc and tcmalloc are loaded with dlopen when installed, without interposing them on
+ * the rest of the process.
+ */
+
+#define _GNU_SOURCE
+#include "allocator.h"
+#include "LYMalloc.h"
+#include <dlfcn.h>
+
+static Allocator systemAllocator = { "system", malloc, calloc, aligned_alloc, realloc, free };
+static Allocator lyAllocator = { "lymalloc", LYMalloc, LYCalloc, LYAlignedAlloc, LYRealloc, LYFree };
+static Allocator jemallocAllocator = { "jemalloc" };
+static Allocator tcmallocAllocator = { "tcmalloc" };
+
+// Resolve the five entry points from the first library that loads and exports all of them
+static Allocator* loadAllocator(Allocator* allocator, const char* const* libraries, const char* const* symbols) {
+    if (allocator->Allocate) {
+        return allocator;
+    }
+
+    for (int i = 0; libraries[i] != NULL; i++) {
+        void* handle = dlopen(libraries[i], RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            continue;
+        }
+        void* allocate = dlsym(handle, symbols[0]);
+        void* allocateZeroed = dlsym(handle, symbols[1]);
+        void* allocateAligned = dlsym(handle, symbols[2]);
+        void* reallocate = dlsym(handle, symbols[3]);
+        void* release = dlsym(handle, symbols[4]);
+        if (allocate && allocateZeroed && allocateAligned && reallocate && release) {
+            allocator->AllocateZeroed = (void* (*)(size_t, size_t))allocateZeroed;
+            allocator->AllocateAligned = (void* (*)(size_t, size_t))allocateAligned;
+            allocator->Reallocate = (void* (*)(void*, size_t))reallocate;
+            allocator->Free = (void (*)(void*))release;
+            allocator->Allocate = (void* (*)(size_t))allocate;
+            return allocator;
+        }
+        dlclose(handle);
+    }
+    return NULL;
+}
+
+Allocator* findAllocator(const char* name) {
+    static const char* const jemallocLibraries[] = { "libjemalloc.so.2", "libjemalloc.so", NULL };
+    static const char* const jemallocSymbols[] = { "malloc", "calloc", "aligned_alloc", "realloc", "free" };
+    static const char* const tcmallocLibraries[] = {
+        "libtcmalloc_minimal.so.4", "libtcmalloc.so.4", "libtcmalloc_minimal.so", "libtcmalloc.so", NULL
+    };
+    static const char* const tcmallocSymbols[] = { "tc_malloc", "tc_calloc", "tc_memalign", "tc_realloc", "tc_free" };
+
+    if (strcmp(name, "system") == 0) {
+        return &systemAllocator;
+    }
+    if (strcmp(name, "lymalloc") == 0) {
+        return &lyAllocator;
+    }
+    if (strcmp(name, "jemalloc") == 0) {
+        return loadAllocator(&jemallocAllocator, jemallocLibraries, jemallocSymbols);
+    }
+    if (strcmp(name, "tcmalloc") == 0) {
+        return loadAllocator(&tcmallocAllocator, tcmallocLibraries, tcmallocSymbols);
+    }
+    return NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stddef.h>
+
+// Allocator under test. Every entry point follows the C library contract of its namesake
+// (malloc, calloc, aligned_alloc, realloc, free), so any malloc implementation fits.
+typedef struct Allocator {
+    const char* name;
+    void* (*Allocate)(size_t size);
+    void* (*AllocateZeroed)(size_t count, size_t size);
+    void* (*AllocateAligned)(size_t alignment, size_t size);
+    void* (*Reallocate)(void* ptr, size_t size);
+    void (*Free)(void* ptr);
+} Allocator;
+
+// "system", "lymalloc", "jemalloc" or "tcmalloc"; NULL when the library is not installed
+Allocator* findAllocator(const char* name);
+
+#endif
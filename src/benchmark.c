@@ -1,25 +1,350 @@
 #include "LYMalloc.h"
 #include "benchmark.h"
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-void benchmark(char *allocator_name, void *(*alloc_func)(size_t), void (*free_func)(void *), int num_threads, int iteration) {
+// Cheapest monotonic clock available: the TSC on x86, clock_gettime elsewhere
+uint64_t read_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_lfence();  // Keep the read from drifting ahead of the timed call
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Calibrated once against CLOCK_MONOTONIC over about 20 ms
+double ticks_per_ns(void) {
+    static double rate;
+    if (rate == 0) {
+        uint64_t start_ns = wall_ns(), start_ticks = read_ticks();
+        while (wall_ns() - start_ns < 20000000) {
+        }
+        rate = (double)(read_ticks() - start_ticks) / (wall_ns() - start_ns);
+    }
+    return rate;
+}
+
+static int histogram_bucket(uint64_t value) {
+    if (value < (1 << HIST_SUB_BITS)) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// Largest value that lands in the bucket
+static uint64_t histogram_bucket_top(int bucket) {
+    if (bucket < (1 << HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((1 << HIST_SUB_BITS) + (bucket & ((1 << HIST_SUB_BITS) - 1))) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_record(latency_histogram *hist, uint64_t ticks) {
+    hist->counts[histogram_bucket(ticks)]++;
+    hist->total++;
+    if (ticks > hist->max) {
+        hist->max = ticks;
+    }
+}
+
+void histogram_merge(latency_histogram *into, const latency_histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+// Value at or below which the given fraction of samples fall, as the top of its bucket
+uint64_t histogram_percentile(const latency_histogram *hist, double percentile) {
+    uint64_t target = (uint64_t)(percentile * hist->total + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            uint64_t top = histogram_bucket_top(i);
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+#define PERF_CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_COUNTERS] = {
+    [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1D_MISSES] = {"L1d-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    [PERF_LLC_MISSES] = {"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_DTLB_MISSES] = {"dTLB-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    [PERF_PAGE_FAULTS] = {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+// Opens and enables every event for the calling thread. User space only, so that
+// perf_event_paranoid 2 still allows it; events the kernel refuses are left at -1.
+void perf_counters_open(perf_counters *counters) {
+    memset(counters, 0, sizeof(*counters));
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+// Disables, reads and closes the thread's events
+void perf_counters_stop(perf_counters *counters) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        uint64_t data[3];  // value, time enabled, time running
+        if (counters->fds[i] < 0) {
+            counters->missing[i] = 1;
+            continue;
+        }
+        if (read(counters->fds[i], data, sizeof(data)) != sizeof(data) || (data[2] == 0 && data[1] != 0)) {
+            counters->missing[i] = 1;  // Never got a hardware counter
+        }
+        else {
+            counters->values[i] = data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+        }
+        close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
+
+void perf_counters_merge(perf_counters *into, const perf_counters *from) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        into->values[i] += from->values[i];
+        into->missing[i] += from->missing[i];
+    }
+}
+
+static size_t read_rss(int fd) {
+    char buf[128];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    unsigned long size, resident;
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+        return 0;
+    }
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void *rss_sampler_routine(void *arg) {
+    rss_sampler *sampler = arg;
+    struct timespec interval = {0, RSS_SAMPLE_US * 1000};
+    while (!sampler->done) {
+        size_t rss = read_rss(sampler->fd);
+        if (rss > sampler->peak) {
+            sampler->peak = rss;
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// Records the baseline and polls /proc/self/statm until rss_sampler_stop()
+void rss_sampler_start(rss_sampler *sampler) {
+    memset(sampler, 0, sizeof(*sampler));
+    sampler->fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (sampler->fd < 0) {
+        return;
+    }
+    sampler->baseline = sampler->peak = read_rss(sampler->fd);
+    if (pthread_create(&sampler->thread, NULL, rss_sampler_routine, sampler) != 0) {
+        sampler->done = 1;
+    }
+}
+
+// Takes the steady-state sample; the peak also covers it in case the run outpaced the poller
+void rss_sampler_stop(rss_sampler *sampler) {
+    if (sampler->fd < 0) {
+        return;
+    }
+    if (!sampler->done) {
+        sampler->done = 1;
+        pthread_join(sampler->thread, NULL);
+    }
+    sampler->steady = read_rss(sampler->fd);
+    if (sampler->steady > sampler->peak) {
+        sampler->peak = sampler->steady;
+    }
+    close(sampler->fd);
+}
+
+static void print_counters(const char *allocator_name, int num_threads, const perf_counters *counters) {
+    printf("%s : %d threads : counters:", allocator_name, num_threads);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (counters->missing[i]) {
+            printf(" %s n/a", perf_events[i].name);
+        }
+        else {
+            printf(" %s %llu", perf_events[i].name, (unsigned long long)counters->values[i]);
+        }
+    }
+    if (!counters->missing[PERF_CYCLES] && !counters->missing[PERF_INSTRUCTIONS] && counters->values[PERF_CYCLES]) {
+        printf(" IPC %.2f", (double)counters->values[PERF_INSTRUCTIONS] / counters->values[PERF_CYCLES]);
+    }
+    printf("\n");
+}
+
+static void print_rss(const char *allocator_name, int num_threads, const rss_sampler *sampler) {
+    if (sampler->fd < 0) {
+        printf("%s : %d threads : RSS n/a\n", allocator_name, num_threads);
+        return;
+    }
+    printf("%s : %d threads : RSS (KB): baseline %zu peak %zu steady %zu\n",
+           allocator_name, num_threads, sampler->baseline / 1024, sampler->peak / 1024, sampler->steady / 1024);
+}
+
+static void print_latency(const char *allocator_name, const char *operation, int num_threads, const latency_histogram *hist) {
+    double rate = ticks_per_ns();
+    printf("%s : %d threads : %s latency (ns): p50 %.0f p99 %.0f p99.9 %.0f max %.0f\n",
+           allocator_name, num_threads, operation,
+           histogram_percentile(hist, 0.50) / rate, histogram_percentile(hist, 0.99) / rate,
+           histogram_percentile(hist, 0.999) / rate, hist->max / rate);
+}
+
+// Relative change of other against base, as a signed percentage
+static void print_change(const char *name, double base, double other) {
+    if (base > 0) {
+        printf(" : %s %+.1f%%", name, (other / base - 1) * 100);
+    }
+    else {
+        printf(" : %s n/a", name);
+    }
+}
+
+// Compares two runs of the same workload: throughput and every counter both runs have
+void print_delta(const char *label, const benchmark_result *base, const benchmark_result *other) {
+    printf("%s", label);
+    print_change("throughput", other->seconds, base->seconds);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (!base->counters.missing[i] && !other->counters.missing[i]) {
+            print_change(perf_events[i].name, base->counters.values[i], other->counters.values[i]);
+        }
+        else {
+            printf(" : %s n/a", perf_events[i].name);
+        }
+    }
+    print_change("peak RSS", base->rss.peak, other->rss.peak);
+    printf("\n");
+}
+
+// LYMalloc through LY_MALLOC_CONST, with the size class of ALLOC_SIZE resolved while compiling
+void *lymalloc_const(size_t size) {
+    (void)size;  // benchmark() always asks for ALLOC_SIZE
+    return LY_MALLOC_CONST(ALLOC_SIZE);
+}
+
+// result, if not NULL, receives the time, the summed counters and the RSS samples
+void benchmark(char *allocator_name, void *(*alloc_func)(size_t), void (*free_func)(void *), int num_threads, int iteration, benchmark_result *result) {
     double start_time, end_time;
-    if (strcmp(allocator_name, "LYMalloc") == 0) {
+    if (alloc_func == LYMalloc || alloc_func == lymalloc_const) {
         initMemoryAllocator(num_threads);
     }
+
+    // One alloc and one free histogram per thread, merged once the threads are done
+    latency_histogram *histograms = aligned_alloc(CACHE_LINE_SIZE, 2 * num_threads * sizeof(latency_histogram));
+    memset(histograms, 0, 2 * num_threads * sizeof(latency_histogram));
+    // Counters are per thread (inherited ones would miss the already running OpenMP pool)
+    perf_counters *counters = aligned_alloc(CACHE_LINE_SIZE, num_threads * sizeof(perf_counters));
+    rss_sampler sampler;
+    ticks_per_ns();
+
+    rss_sampler_start(&sampler);
     start_time = omp_get_wtime();
 
     #pragma omp parallel num_threads(num_threads)
     {
+        latency_histogram *alloc_hist = &histograms[2 * omp_get_thread_num()];
+        latency_histogram *free_hist = alloc_hist + 1;
+        perf_counters *thread_counters = &counters[omp_get_thread_num()];
+        perf_counters_open(thread_counters);
         for (int i = 0; i < iteration; ++i) {
+            uint64_t t0 = read_ticks();
             char *memory = (char *)alloc_func(ALLOC_SIZE);
+            uint64_t t1 = read_ticks();
             memset(memory, 0, ALLOC_SIZE); // Simulate memory usage
+            uint64_t t2 = read_ticks();
             free_func(memory);
+            uint64_t t3 = read_ticks();
+            histogram_record(alloc_hist, t1 - t0);
+            histogram_record(free_hist, t3 - t2);
         }
+        perf_counters_stop(thread_counters);
     }
 
     end_time = omp_get_wtime();
+    rss_sampler_stop(&sampler);
     printf("%s : Time: %f seconds\n", allocator_name, end_time - start_time);
-    if (strcmp(allocator_name, "LYMalloc") == 0) {
+
+    for (int i = 1; i < num_threads; i++) {
+        histogram_merge(&histograms[0], &histograms[2 * i]);
+        histogram_merge(&histograms[1], &histograms[2 * i + 1]);
+    }
+    print_latency(allocator_name, "alloc", num_threads, &histograms[0]);
+    print_latency(allocator_name, "free", num_threads, &histograms[1]);
+    free(histograms);
+
+    for (int i = 1; i < num_threads; i++) {
+        perf_counters_merge(&counters[0], &counters[i]);
+    }
+    print_counters(allocator_name, num_threads, &counters[0]);
+    print_rss(allocator_name, num_threads, &sampler);
+    if (result) {
+        result->seconds = end_time - start_time;
+        result->counters = counters[0];
+        result->rss = sampler;
+    }
+    free(counters);
+
+    if (alloc_func == LYMalloc || alloc_func == lymalloc_const) {
         freeMemoryAllocator(num_threads);
     }
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <omp.h>
 #include <string.h> // For memset to simulate usage
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 // #include <jemalloc/jemalloc.h>
 
 
@@ -14,6 +16,62 @@
 
 #define ALLOC_SIZE 64
 
-void benchmark(char *allocator_name, void *(*alloc_func)(size_t), void (*free_func)(void *), int num_threads, int iteration);
+// Latency histograms: log-linear buckets, 2^HIST_SUB_BITS per power of two (about 6% error)
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} __attribute__((aligned(CACHE_LINE_SIZE))) latency_histogram;
+
+// Hardware and software events counted around each run, see perf_counters_open()
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_L1D_MISSES 2
+#define PERF_LLC_MISSES 3
+#define PERF_DTLB_MISSES 4
+#define PERF_PAGE_FAULTS 5
+#define PERF_COUNTERS 6
+
+#define RSS_SAMPLE_US 1000 // Interval between /proc/self/statm samples
+
+typedef struct {
+    int fds[PERF_COUNTERS];  // -1 where the kernel refused the event
+    uint64_t values[PERF_COUNTERS];  // Scaled up when the PMU was multiplexed
+    int missing[PERF_COUNTERS];  // Threads that could not count the event
+} __attribute__((aligned(CACHE_LINE_SIZE))) perf_counters;
+
+typedef struct {
+    pthread_t thread;
+    int fd;  // /proc/self/statm, -1 if unreadable
+    volatile int done;
+    size_t baseline;  // Resident bytes before the run
+    size_t peak;  // Largest sample during the run
+    size_t steady;  // Resident bytes once every thread has finished
+} rss_sampler;
+
+// What one benchmark() run measured, for comparing runs
+typedef struct {
+    double seconds;
+    perf_counters counters;  // Summed over the threads
+    rss_sampler rss;
+} benchmark_result;
+
+void histogram_record(latency_histogram *hist, uint64_t ticks);
+void histogram_merge(latency_histogram *into, const latency_histogram *from);
+uint64_t histogram_percentile(const latency_histogram *hist, double percentile);
+uint64_t read_ticks(void);
+double ticks_per_ns(void);
+void perf_counters_open(perf_counters *counters);
+void perf_counters_stop(perf_counters *counters);
+void perf_counters_merge(perf_counters *into, const perf_counters *from);
+void rss_sampler_start(rss_sampler *sampler);
+void rss_sampler_stop(rss_sampler *sampler);
+
+void *lymalloc_const(size_t size);
+void benchmark(char *allocator_name, void *(*alloc_func)(size_t), void (*free_func)(void *), int num_threads, int iteration, benchmark_result *result);
+void print_delta(const char *label, const benchmark_result *base, const benchmark_result *other);
 
 #endif
\ No newline at end of file
@@ -1,271 +1,405 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
-#include <omp.h>
-#include "allocator.h" 
+/*
+ * Allocator benchmark suite: standard multi-threaded allocation workloads run against every
+ * allocator in allocator.h over a sweep of thread counts.
+ *
+ *     make bench
+ *     ./bench [-a system,lymalloc,jemalloc,tcmalloc] [-w larson,threadtest,xmalloc,shbench,realloc]
+ *             [-t 1,2,4,8] [-s scale] [-f csv|json]
+ *
+ * Every thread does the same amount of work whatever the thread count, so a scalable
+ * allocator keeps ops/s per thread flat. Results go to stdout, one record per
+ * (allocator, workload, threads); allocators that are not installed are skipped.
+ *
+ * Workloads:
+ * - larson: threads replace random objects in a slot array, then hand the array to a fresh
+ *   thread that frees what its predecessor allocated (server-style thread churn)
+ * - threadtest: allocate a batch of small objects, free them all, repeat (Hoard threadtest)
+ * - xmalloc: every object is freed by the next thread in a ring (producer/consumer)
+ * - shbench: mixed sizes with a small-object bias, freed out of order (SmartHeap shbench)
+ * - realloc: interleaved buffers grown with realloc up to 256 KB
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "allocator.h"
 #include "benchmark.h"
 
-size_t num_allocs;
-size_t *sizes;
-size_t *alignments;
-
-void benchmark_Single_Allocation(Allocator* allocator, size_t size, size_t alignment) {
-    printf("BENCHMARK: Single Allocation\n");
-    printf("\tSize: \t%zu\n", size);
-    printf("\tAlignment: \t%zu\n", alignment);
+#define MAX_THREADS 256
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+#define LARSON_OPS 20000
+#define THREADTEST_OBJECTS 1000
+#define THREADTEST_ROUNDS 100
+#define XMALLOC_OBJECTS 100000
+#define XMALLOC_RING 1024
+#define SHBENCH_BATCH 100
+#define SHBENCH_ROUNDS 1000
+#define REALLOC_BUFFERS 4
+#define REALLOC_MAX (256 * 1024)
+#define REALLOC_ROUNDS 50
+
+typedef struct Worker {
+    Allocator* allocator;
+    int id;
+    int threads;
+    int scale;
+    int round;
+    uint64_t ops;  // Allocator calls made
+    uint64_t seed;
+    void* shared;  // Workload-specific state
+} __attribute__((aligned(CACHE_LINE_SIZE))) Worker;
+
+typedef struct {
+    const char* name;
+    int rounds;  // Fresh threads per round, all rounds are timed together
+    void* (*body)(void* worker);
+    void* (*setup)(Allocator* allocator, int threads, int scale);  // Optional
+    void (*teardown)(Allocator* allocator, int threads, void* shared);
+} Workload;
+
+static uint64_t nextRandom(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
 
-    // start timer
-    double start = omp_get_wtime();
+static size_t randomSize(uint64_t* state, size_t min, size_t max) {
+    return min + nextRandom(state) % (max - min + 1);
+}
 
-    // perform allocation
-    void *ptr = allocator->Allocator(allocator, size, alignment);
-        if (ptr == NULL) {
-            fprintf(stderr, "Allocation failed\n");
-            return;
-        }
-    
-    // check alignment
-    if ((uintptr_t)ptr % alignment != 0) {
-        fprintf(stderr, "Incorrect alignment\n");
+// Start one thread per worker and wait for all of them
+static uint64_t runWorkers(Worker* workers, int threads, void* (*body)(void*)) {
+    pthread_t ids[MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&ids[i], NULL, body, &workers[i]);
     }
+    uint64_t ops = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        ops += workers[i].ops;
+    }
+    return ops;
+}
 
-    // end timer
-    double end = omp_get_wtime();
-
-    // calculate elapsed time in milliseconds
-    double elapsed = (end - start) / * 1000.0;
-
-    // print time
-    printf("Allocation Time: %.2f ms\n", elapsed);
+// ---- larson ----
 
-    // free memory
-    allocator->Free(allocator, ptr);
+typedef struct {
+    void** slots;  // threads * LARSON_SLOTS objects, each thread owns a stripe
+} LarsonState;
 
+static void* larsonSetup(Allocator* allocator, int threads, int scale) {
+    LarsonState* state = calloc(1, sizeof(LarsonState));
+    state->slots = calloc((size_t)threads * LARSON_SLOTS, sizeof(void*));
+    uint64_t seed = 42;
+    for (size_t i = 0; i < (size_t)threads * LARSON_SLOTS; i++) {
+        state->slots[i] = allocator->Allocate(randomSize(&seed, 10, 400));
+    }
+    return state;
 }
 
-void benchmark_Single_Free(Allocator* allocator, size_t size, size_t alignment) {
-    printf("BENCHMARK: Single Free\n");
-    printf("\tSize: \t%zu\n", size);
-    printf("\tAlignment: \t%zu\n", alignment);
-
-    // perform allocation
-    void *ptr = allocator->Allocator(allocator, size, alignment);
-    if (ptr == NULL) {
-        fprintf(stderr, "Allocation failed for free\n");
-        return;
+static void* larsonBody(void* arg) {
+    Worker* worker = arg;
+    LarsonState* state = worker->shared;
+    // Each round shifts the stripes by one, so a thread frees what another one allocated
+    int stripe = (worker->id + worker->round) % worker->threads;
+    void** slots = state->slots + (size_t)stripe * LARSON_SLOTS;
+
+    for (int i = 0; i < LARSON_OPS * worker->scale; i++) {
+        size_t slot = nextRandom(&worker->seed) % LARSON_SLOTS;
+        worker->allocator->Free(slots[slot]);
+        char* ptr = worker->allocator->Allocate(randomSize(&worker->seed, 10, 400));
+        ptr[0] = (char)i;
+        slots[slot] = ptr;
+        worker->ops += 2;
     }
-
-    // start timer
-    double start = omp_get_wtime();
-
-    // execute free
-    allocator->Free(allocator, ptr);
-
-    // end timer
-    double end = omp_get_wtime();
-
-    // calculate elapsed time
-    double elapsed = (end - start) * 1000.0; 
-
-    // print time
-    printf("Free time: %.2f ms\n", elapsed);
+    return NULL;
 }
 
-void benchmark_Multiple_Allocation(Allocator* allocator) {
-    printf("BENCHMARK: Multiple Allocation\n");
-    printf("Performing %zu allocations.\n", num_allocs);
+static void larsonTeardown(Allocator* allocator, int threads, void* shared) {
+    LarsonState* state = shared;
+    for (size_t i = 0; i < (size_t)threads * LARSON_SLOTS; i++) {
+        allocator->Free(state->slots[i]);
+    }
+    free(state->slots);
+    free(state);
+}
 
-    // initialize allocator
-    allocator->init(allocator);
+// ---- threadtest ----
 
-    // start timer
-    double start = omp_get_wtime();
+static void* threadtestBody(void* arg) {
+    Worker* worker = arg;
+    char* objects[THREADTEST_OBJECTS];
 
-    // perform multiple allocations in parallel using OpenMP
-    #pragma omp parallel for
-    for (size_t i = 0; i < num_allocs; i++) {
-        void* ptr = allocator->Allocate(allocator, sizes[i], alignments[i]);
-        if (ptr == NULL) {
-            #pragma omp critical
-            fprintf(stderr, "Allocation failed for size %zu and alignment %zu.\n", sizes[i], alignments[i]);
+    for (int round = 0; round < THREADTEST_ROUNDS * worker->scale; round++) {
+        for (int i = 0; i < THREADTEST_OBJECTS; i++) {
+            objects[i] = worker->allocator->Allocate(ALLOC_SIZE);
+            objects[i][0] = (char)i;
+        }
+        for (int i = 0; i < THREADTEST_OBJECTS; i++) {
+            worker->allocator->Free(objects[i]);
         }
+        worker->ops += 2 * THREADTEST_OBJECTS;
     }
-
-    // wait for all threads to finish
-    #pragma omp barrier
-
-    // end timer
-     double end = omp_get_wtime();
-
-    // calculate elapsed time
-    double elapsed = (end - start) * 1000.0;
-
-    // print time
-    printf("Total allocation time: %.2f ms for %zu operations.\n", elapsed, num_allocs);
+    return NULL;
 }
 
-void benchmark_Multiple_Free(Allocator* allocator) {
-    printf("BENCHMARK: Multiple Free\n");
-    printf("Performing %zu frees.\n", num_allocs);
+// ---- xmalloc ----
 
-    // initialize allocator
-    allocator->init(allocator);
+// Single-producer single-consumer ring; thread i produces into ring (i + 1) % threads
+typedef struct {
+    void* slots[XMALLOC_RING];
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));  // Written by the producer
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE)));  // Written by the consumer
+} __attribute__((aligned(CACHE_LINE_SIZE))) Ring;
 
-    // allocate memory for later free
-    void** pointers = malloc(num_allocs * sizeof(void*));
-    if (pointers == NULL) {
-        fprintf(stderr, "Failed to allocate memory for pointers.\n");
-        return;
+static void* xmallocSetup(Allocator* allocator, int threads, int scale) {
+    Ring* rings;
+    if (posix_memalign((void**)&rings, CACHE_LINE_SIZE, threads * sizeof(Ring)) != 0) {
+        return NULL;
     }
+    memset(rings, 0, threads * sizeof(Ring));
+    return rings;
+}
 
-    // perform multiple allocations
-    for (size_t i = 0; i < num_allocs; i++) {
-        pointers[i] = allocator->Allocate(allocator, sizes[i], alignments[i]);
-        if (pointers[i] == NULL) {
-            fprintf(stderr, "Allocation failed for size %zu and alignment %zu.\n", sizes[i], alignments[i]);
+static void* xmallocBody(void* arg) {
+    Worker* worker = arg;
+    Ring* rings = worker->shared;
+    Ring* out = &rings[(worker->id + 1) % worker->threads];
+    Ring* in = &rings[worker->id];
+    size_t total = (size_t)XMALLOC_OBJECTS * worker->scale;
+    size_t produced = 0, consumed = 0;
+
+    while (produced < total || consumed < total) {
+        int progress = 0;
+        size_t tail = out->tail;
+        if (produced < total && tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < XMALLOC_RING) {
+            char* ptr = worker->allocator->Allocate(randomSize(&worker->seed, 8, 256));
+            ptr[0] = 1;
+            out->slots[tail % XMALLOC_RING] = ptr;
+            __atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+            produced++;
+            progress = 1;
         }
-    }
 
-    // start timer
-   double start = omp_get_wtime();
+        size_t head = in->head;
+        size_t available = __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE);
+        for (; head != available; head++, consumed++) {
+            worker->allocator->Free(in->slots[head % XMALLOC_RING]);
+            progress = 1;
+        }
+        __atomic_store_n(&in->head, head, __ATOMIC_RELEASE);
 
-    // perform multiple frees in parallel using OpenMP
-    #pragma omp parallel for
-    for (size_t i = 0; i < num_allocs; i++) {
-        if (pointers[i] != NULL) {
-            allocator->Free(allocator, pointers[i]);
+        if (!progress) {
+            sched_yield();  // Neighbours are behind; let them run when there are fewer CPUs than threads
         }
     }
-
-    // end timer
-    double end = omp_get_wtime();
-
-    // calculate elapsed time
-    double elapsed = (end - start) * 1000.0;
-
-    // print time
-    printf("Total free time: %.2f ms for %zu operations.\n", elapsed, num_allocs);
-
-    // free memory
-    free(pointers);
+    worker->ops = 2 * total;
+    return NULL;
 }
 
-void benchmark_Random_Allocation(Allocator* allocator) {
-    printf("BENCHMARK: Random Allocation\n");
-
-    // initialize random seed
-    srand((unsigned)time(NULL));
+static void xmallocTeardown(Allocator* allocator, int threads, void* shared) {
+    free(shared);
+}
 
-    // initialize allocator
-    allocator->init(allocator);
+// ---- shbench ----
 
-    // allocate memory for pointers
-    void** pointers = malloc(num_allocs * sizeof(void*));
-    if (pointers == NULL) {
-        fprintf(stderr, "Failed to allocate memory for pointers.\n");
-        return;
+static size_t shbenchSize(uint64_t* seed) {
+    uint64_t pick = nextRandom(seed) % 100;
+    if (pick < 90) {
+        return randomSize(seed, 1, 100);
     }
+    if (pick < 99) {
+        return randomSize(seed, 101, 1000);
+    }
+    return randomSize(seed, 1001, 10000);
+}
 
-    // start timer
-    double start = omp_get_wtime();
-
-    // perform random allocations in parallel using OpenMP
-    #pragma omp parallel for
-    for (size_t i = 0; i < num_allocs; i++) {
-
-        // ensure different seeds in different threads
-        int thread_id = omp_get_thread_num();
-        unsigned int seed = time(NULL) ^ (thread_id + 1); // Ensure different seeds in different threads
-
-        // randomly select size and alignment
-        size_t index = rand_r(&seed) % num_allocs;
-        size_t size = sizes[index];
-        size_t alignment = alignments[index];
-
-        // perform allocation
-        void* ptr = allocator->Allocate(allocator, size, alignment);
-        if (ptr == NULL) {
-            # pragma omp critical
-            fprintf(stderr, "Allocation failed for size %zu and alignment %zu at index %zu.\n", size, alignment, index);
-        } else {
-            pointers[i] = ptr;
+static void* shbenchBody(void* arg) {
+    Worker* worker = arg;
+    char* objects[SHBENCH_BATCH];
+
+    for (int round = 0; round < SHBENCH_ROUNDS * worker->scale; round++) {
+        for (int i = 0; i < SHBENCH_BATCH; i++) {
+            size_t size = shbenchSize(&worker->seed);
+            // Every sixteenth object asks for cache-line alignment
+            objects[i] = i % 16 == 0 ?
+                worker->allocator->AllocateAligned(CACHE_LINE_SIZE, (size + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1)) :
+                worker->allocator->Allocate(size);
+            objects[i][0] = (char)i;
         }
+        // Free out of allocation order: odd slots backwards, then even slots backwards
+        for (int i = SHBENCH_BATCH - 1; i >= 0; i -= 2) {
+            worker->allocator->Free(objects[i]);
+        }
+        for (int i = SHBENCH_BATCH - 2; i >= 0; i -= 2) {
+            worker->allocator->Free(objects[i]);
+        }
+        worker->ops += 2 * SHBENCH_BATCH;
     }
+    return NULL;
+}
 
-    // end timer
-    double end = omp_get_wtime();
+// ---- realloc ----
 
-    // calculate elapsed time
-    double elapsed = (end - start) * 1000.0;
+static void* reallocBody(void* arg) {
+    Worker* worker = arg;
 
-    // print time
-    printf("Total random allocation time: %.2f ms for %zu operations.\n", elapsed, num_allocs);
+    for (int round = 0; round < REALLOC_ROUNDS * worker->scale; round++) {
+        char* buffers[REALLOC_BUFFERS] = { NULL };
+        size_t sizes[REALLOC_BUFFERS];
+        for (int b = 0; b < REALLOC_BUFFERS; b++) {
+            sizes[b] = 16 + b;
+        }
 
-    // free memory
-    for (size_t i = 0; i < num_allocs; i++) {
-        if (pointers[i] != NULL) {
-            allocator->Free(allocator, pointers[i]);
+        // Grow the buffers in turn, so none can always extend into the space after it
+        int growing = REALLOC_BUFFERS;
+        while (growing > 0) {
+            growing = 0;
+            for (int b = 0; b < REALLOC_BUFFERS; b++) {
+                if (sizes[b] > REALLOC_MAX) {
+                    continue;
+                }
+                buffers[b] = worker->allocator->Reallocate(buffers[b], sizes[b]);
+                buffers[b][sizes[b] - 1] = (char)b;
+                sizes[b] = sizes[b] * 3 / 2 + 8;
+                worker->ops++;
+                growing++;
+            }
+        }
+        for (int b = 0; b < REALLOC_BUFFERS; b++) {
+            worker->allocator->Free(buffers[b]);
+            worker->ops++;
         }
     }
-
-    // clean up
-    free(pointers);
+    return NULL;
 }
 
-void benchmark_Random_Free(Allocator* allocator) {
-    printf("BENCHMARK: Random Free\n");
+static const Workload workloads[] = {
+    { "larson", LARSON_ROUNDS, larsonBody, larsonSetup, larsonTeardown },
+    { "threadtest", 1, threadtestBody, NULL, NULL },
+    { "xmalloc", 1, xmallocBody, xmallocSetup, xmallocTeardown },
+    { "shbench", 1, shbenchBody, NULL, NULL },
+    { "realloc", 1, reallocBody, NULL, NULL },
+};
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
 
-    // initialize random seed
-    srand((unsigned)time(NULL));
+static double runWorkload(const Workload* workload, Allocator* allocator, int threads, int scale, uint64_t* ops) {
+    Worker workers[MAX_THREADS];
+    void* shared = workload->setup ? workload->setup(allocator, threads, scale) : NULL;
 
-    // initialize allocator
-    allocator->init(allocator);
+    *ops = 0;
+    double start = omp_get_wtime();
+    for (int round = 0; round < workload->rounds; round++) {
+        for (int i = 0; i < threads; i++) {
+            workers[i] = (Worker){ allocator, i, threads, scale, round, 0, 0x9E3779B97F4A7C15ULL * (i + 1) + round, shared };
+        }
+        *ops += runWorkers(workers, threads, workload->body);
+    }
+    double elapsed = omp_get_wtime() - start;
 
-    // execute random free operations and store pointers
-    void** pointers = malloc(num_allocs * sizeof(void*));
-    if (pointers == NULL) {
-        fprintf(stderr, "Failed to allocate memory for pointers.\n");
-        return;
+    if (workload->teardown) {
+        workload->teardown(allocator, threads, shared);
     }
+    return elapsed;
+}
 
-    // perform random allocations
-    for (size_t i = 0; i < num_allocs; i++) {
-        pointers[i] = allocator->Allocate(allocator, sizes[i], alignments[i]);
-        if (pointers[i] == NULL) {
-            fprintf(stderr, "Allocation failed for size %zu and alignment %zu.\n", sizes[i], alignments[i]);
-            free(pointers);
-            return;
-        }
+// Split a comma-separated option in place
+static int splitList(char* list, char** items, int max) {
+    int count = 0;
+    for (char* item = strtok(list, ","); item != NULL && count < max; item = strtok(NULL, ",")) {
+        items[count++] = item;
     }
+    return count;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [-a allocators] [-w workloads] [-t threads] [-s scale] [-f csv|json]\n", program);
+    fprintf(stderr, "  lists are comma-separated, e.g. -a system,lymalloc -t 1,2,4,8\n");
+}
 
-    // start timer
-     double start = omp_get_wtime();
-
-    // perform random frees in parallel using OpenMP
-    #pragma omp parallel for
-    for (size_t i = 0; i < num_allocs; i++) {
-        // ensure different seeds in different threads
-        int thread_id = omp_get_thread_num();
-        unsigned int seed = time(NULL) ^ (thread_id + 1); 
-        
-        size_t index = rand() % num_allocs; 
-        if (pointers[index] != NULL) {
-            allocator->Free(allocator, pointers[index]);
-            pointers[index] = NULL;
+int main(int argc, char* argv[]) {
+    char allocatorList[256] = "system,lymalloc,jemalloc,tcmalloc";
+    char workloadList[256] = "larson,threadtest,xmalloc,shbench,realloc";
+    char threadList[256] = "1,2,4,8";
+    int scale = 1;
+    int json = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "a:w:t:s:f:h")) != -1) {
+        switch (option) {
+        case 'a': snprintf(allocatorList, sizeof(allocatorList), "%s", optarg); break;
+        case 'w': snprintf(workloadList, sizeof(workloadList), "%s", optarg); break;
+        case 't': snprintf(threadList, sizeof(threadList), "%s", optarg); break;
+        case 's': scale = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+        case 'f': json = strcmp(optarg, "json") == 0; break;
+        default: usage(argv[0]); return option == 'h' ? 0 : 1;
         }
     }
 
-    // end timer
-     double end = omp_get_wtime();
+    char* allocatorNames[16];
+    char* workloadNames[16];
+    char* threadNames[32];
+    int allocatorCount = splitList(allocatorList, allocatorNames, 16);
+    int workloadCount = splitList(workloadList, workloadNames, 16);
+    int threadCount = splitList(threadList, threadNames, 32);
 
-    // calculate elapsed time
-    double elapsed = (end - start) * 1000.0;
+    if (json) {
+        printf("[\n");
+    }
+    else {
+        printf("allocator,workload,threads,ops,seconds,mops_per_sec\n");
+    }
 
-    // print time
-    printf("Total random free time: %.2f ms for %zu operations.\n", elapsed, num_allocs);
+    int records = 0;
+    for (int a = 0; a < allocatorCount; a++) {
+        Allocator* allocator = findAllocator(allocatorNames[a]);
+        if (!allocator) {
+            fprintf(stderr, "skipping %s: not available\n", allocatorNames[a]);
+            continue;
+        }
+        for (int w = 0; w < workloadCount; w++) {
+            const Workload* workload = NULL;
+            for (int i = 0; i < NUM_WORKLOADS; i++) {
+                if (strcmp(workloads[i].name, workloadNames[w]) == 0) {
+                    workload = &workloads[i];
+                }
+            }
+            if (!workload) {
+                fprintf(stderr, "skipping %s: unknown workload\n", workloadNames[w]);
+                continue;
+            }
+            for (int t = 0; t < threadCount; t++) {
+                int threads = atoi(threadNames[t]);
+                if (threads < 1 || threads > MAX_THREADS) {
+                    continue;
+                }
+
+                uint64_t ops;
+                double seconds = runWorkload(workload, allocator, threads, scale, &ops);
+                double mops = seconds > 0 ? ops / seconds / 1e6 : 0;
+                if (json) {
+                    printf("%s  {\"allocator\": \"%s\", \"workload\": \"%s\", \"threads\": %d, "
+                           "\"ops\": %llu, \"seconds\": %.6f, \"mops_per_sec\": %.3f}",
+                           records ? ",\n" : "", allocator->name, workload->name, threads,
+                           (unsigned long long)ops, seconds, mops);
+                }
+                else {
+                    printf("%s,%s,%d,%llu,%.6f,%.3f\n", allocator->name, workload->name, threads,
+                           (unsigned long long)ops, seconds, mops);
+                }
+                fflush(stdout);
+                records++;
+            }
+        }
+    }
 
-    // free memory
-    free(pointers);
+    if (json) {
+        printf("\n]\n");
+    }
+    return 0;
 }
-
-
@@ -0,0 +1,70 @@
+/*
+ * Decay of a thread heap whose thread goes idle while holding free pages. Run with
+ * `make test`; exits non-zero if a check fails.
+ */
+
+#include "LYMalloc.h"
+
+#define IDLE_BLOCKS 64
+#define IDLE_SIZE (48 * 1024)
+#define IDLE_WAIT_MS 2000
+
+static int failures;
+static volatile int done;
+
+static void check(int ok, const char* what) {
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Touch and free a few MB, then sleep without another allocator call until told to stop
+static void* idler(void* arg) {
+    void* blocks[IDLE_BLOCKS];
+    for (int i = 0; i < IDLE_BLOCKS; i++) {
+        blocks[i] = LYMalloc(IDLE_SIZE);
+        memset(blocks[i], 1, IDLE_SIZE);
+    }
+    for (int i = 0; i < IDLE_BLOCKS; i++) {
+        LYFree(blocks[i]);
+    }
+    __atomic_store_n((int*)arg, 1, __ATOMIC_RELEASE);
+    while (!done) {
+        usleep(1000);
+    }
+    return NULL;
+}
+
+int main(void) {
+    LYStats stats;
+    int freed = 0;
+
+    LYSetDecayTime(50, 0);  // Straight to MADV_DONTNEED, so the resident set drops
+    initMemoryAllocator(1);  // Background decay pass, the idle thread never runs it
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, idler, &freed);
+    while (!__atomic_load_n(&freed, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    LYMallocStats(&stats);
+    size_t localFree = stats.localFreeBytes;
+    size_t busy = stats.residentBytes;
+    check(localFree > 0, "idle thread keeps free pages");
+
+    size_t idle = busy;
+    for (int waited = 0; waited < IDLE_WAIT_MS && busy - idle < localFree / 2; waited += 10) {
+        usleep(10 * 1000);
+        LYMallocStats(&stats);
+        idle = stats.residentBytes < busy ? stats.residentBytes : busy;
+    }
+    printf("resident %zu KB busy, %zu KB idle, %zu KB free in the idle heap\n",
+           busy / 1024, idle / 1024, localFree / 1024);
+    check(busy - idle >= localFree / 2, "idle heap's free pages leave the resident set");
+
+    done = 1;
+    pthread_join(thread, NULL);
+    freeMemoryAllocator(1);
+    return failures ? 1 : 0;
+}
@@ -7,11 +7,28 @@ int main(int argc, char *argv[]) {
     int iteration = atoi(argv[3]);
 
     if (c == 1) {
-        benchmark("System malloc", malloc, free, num_threads, iteration);
+        benchmark("System malloc", malloc, free, num_threads, iteration, NULL);
     }
 
     if (c == 2) {
-        benchmark("LYMalloc", LYMalloc, LYFree, num_threads, iteration);
+        benchmark("LYMalloc", LYMalloc, LYFree, num_threads, iteration, NULL);
+    }
+
+    if (c == 3) {
+        // Same run with 4 KB pages, then with huge pages; each run starts from an empty allocator
+        benchmark_result base, huge;
+        benchmark("LYMalloc", LYMalloc, LYFree, num_threads, iteration, &base);
+        LYSetHugePages(1);
+        benchmark("LYMalloc (huge pages)", LYMalloc, LYFree, num_threads, iteration, &huge);
+        print_delta("LYMalloc huge pages vs 4 KB pages", &base, &huge);
+    }
+
+    if (c == 4) {
+        // Out-of-line LYMalloc, then the inline LY_MALLOC_CONST fast path
+        benchmark_result call, inlined;
+        benchmark("LYMalloc", LYMalloc, LYFree, num_threads, iteration, &call);
+        benchmark("LYMalloc (LY_MALLOC_CONST)", lymalloc_const, LYFree, num_threads, iteration, &inlined);
+        print_delta("LY_MALLOC_CONST vs LYMalloc", &call, &inlined);
     }
 
     return 0;
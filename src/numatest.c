@@ -0,0 +1,84 @@
+/*
+ * Node selection under a simulated NUMA topology (LYSetNumaTopology), so it runs on any
+ * machine. Run with `make test`; exits non-zero on the first failed check.
+ */
+
+#include "LYMalloc.h"
+
+#define CHURN_BLOCKS 64
+#define CHURN_SIZE (64 * 1024)
+
+static int failures;
+
+static void check(int ok, const char* what) {
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Allocate and free page blocks on the given node; the thread's free pages go back to its
+// home arena when it exits
+static void* churn(void* arg) {
+    LYSetThreadNode((int)(intptr_t)arg);  // Before the thread's first allocation
+    void* blocks[CHURN_BLOCKS];
+    for (int i = 0; i < CHURN_BLOCKS; i++) {
+        blocks[i] = LYMalloc(CHURN_SIZE);
+        memset(blocks[i], 1, CHURN_SIZE);
+    }
+    for (int i = 0; i < CHURN_BLOCKS; i++) {
+        LYFree(blocks[i]);
+    }
+    return NULL;
+}
+
+// The nodes' arena ranges sit next to each other from arena 0, sized as expected
+static int laidOut(const LYStats* stats, int node0Arenas, int node1Arenas) {
+    return stats->nodeFirstArena[0] == 0 && stats->nodeArenas[0] == node0Arenas &&
+        stats->nodeFirstArena[1] == node0Arenas && stats->nodeArenas[1] == node1Arenas &&
+        stats->arenas >= node0Arenas + node1Arenas;
+}
+
+static void runOnNode(int node) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, churn, (void*)(intptr_t)node);
+    pthread_join(thread, NULL);
+}
+
+int main(void) {
+    LYStats stats;
+
+    // Two nodes of four CPUs: node 0 owns arenas 0-3, node 1 arenas 4-7
+    LYSetNumaTopology("0-3;4-7");
+    LYMallocStats(&stats);
+    check(stats.numaNodes == 2, "0-3;4-7 gives 2 nodes");
+    check(laidOut(&stats, 4, 4), "node 0 owns arenas 0-3, node 1 arenas 4-7");
+
+    runOnNode(1);
+    LYMallocStats(&stats);
+    check(stats.nodeFreeBytes[1] > 0 && stats.nodeFreeBytes[0] == 0, "node 1 thread spills to arenas 4-7");
+    uint64_t grows = stats.systemGrows;
+    size_t node1Free = stats.nodeFreeBytes[1];
+
+    runOnNode(1);
+    LYMallocStats(&stats);
+    check(stats.systemGrows == grows, "second node 1 thread refills from arenas 4-7");
+    check(stats.nodeFreeBytes[0] == 0 && stats.nodeFreeBytes[1] == node1Free, "node 1 pages stay on node 1");
+    check(stats.remoteNodeRefills == 0, "no refill crosses nodes");
+
+    // CPUs above MAX_ARENAS still reach arenas of their own node
+    LYSetNumaTopology("0-63;64-127");
+    LYMallocStats(&stats);
+    check(stats.numaNodes == 2 && laidOut(&stats, MAX_ARENAS / 2, MAX_ARENAS / 2),
+          "0-63;64-127 splits the arenas between 2 nodes");
+    size_t node0Free = stats.nodeFreeBytes[0];
+    runOnNode(1);
+    LYMallocStats(&stats);
+    check(stats.nodeFreeBytes[1] > 0 && stats.nodeFreeBytes[0] == node0Free, "node 1 has arenas of its own");
+
+    LYSetNumaTopology(NULL);
+    LYMallocStats(&stats);
+    check(stats.numaNodes >= 1, "NULL goes back to the system topology");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * Replays an allocation trace recorded with LYMALLOC_TRACE against any allocator:
+ *
+ *     LYMALLOC_TRACE=app.trace LD_PRELOAD=./liblymalloc.so ./app
+ *     ./replay lymalloc app.trace      (or system, jemalloc, tcmalloc; 1 and 2 as in main.c)
+ *
+ * Each recorded thread gets a replay thread that issues its operations in their original
+ * order. An operation on an object another thread produced waits until that operation has
+ * been replayed, so cross-thread frees and hand-offs keep their original interleaving.
+ * Addresses are turned into dense object slots before the clock starts, so the timed loop
+ * does no lookups. Reports time, peak RSS and how it compares to the peak of live bytes.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "benchmark.h"
+#include "LYTrace.h"
+
+#define NO_OBJECT UINT32_MAX
+#define TOUCH_STRIDE 4096  // Write one byte per page so RSS reflects what the program used
+
+typedef struct {
+    uint8_t op;
+    uint32_t object;  // Slot that receives the result, or is freed
+    uint32_t input;  // Slot passed to realloc, NO_OBJECT for none
+    size_t size;
+    size_t alignment;
+    int64_t wait;  // Operation that must be replayed first, -1 when none
+} ReplayOp;
+
+typedef struct {
+    Allocator* allocator;
+    ReplayOp* ops;
+    uint32_t* order;  // Indices into ops, this thread's operations in trace order
+    size_t count;
+    void** objects;
+    uint8_t* done;
+} ReplayThread;
+
+// Address -> slot of the live object at that address, open addressing with linear probing
+typedef struct {
+    uint64_t* keys;
+    uint32_t* values;
+    size_t mask;
+} AddressMap;
+
+static size_t addressSlot(const AddressMap* map, uint64_t address) {
+    size_t i = (size_t)((address >> 4) * 0x9E3779B97F4A7C15ULL) & map->mask;
+    while (map->keys[i] != 0 && map->keys[i] != address) {
+        i = (i + 1) & map->mask;
+    }
+    return i;
+}
+
+static uint32_t addressGet(const AddressMap* map, uint64_t address) {
+    size_t i = addressSlot(map, address);
+    return map->keys[i] ? map->values[i] : NO_OBJECT;
+}
+
+static void addressPut(AddressMap* map, uint64_t address, uint32_t object) {
+    size_t i = addressSlot(map, address);
+    map->keys[i] = address;
+    map->values[i] = object;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones
+static void addressRemove(AddressMap* map, uint64_t address) {
+    size_t i = addressSlot(map, address);
+    if (!map->keys[i]) {
+        return;
+    }
+    size_t j = i;
+    for (;;) {
+        map->keys[i] = 0;
+        for (;;) {
+            j = (j + 1) & map->mask;
+            if (!map->keys[j]) {
+                return;
+            }
+            size_t home = (size_t)((map->keys[j] >> 4) * 0x9E3779B97F4A7C15ULL) & map->mask;
+            if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j)) {
+                continue;  // Still reachable from its home slot
+            }
+            break;
+        }
+        map->keys[i] = map->keys[j];
+        map->values[i] = map->values[j];
+        i = j;
+    }
+}
+
+static long statusKb(const char* field) {
+    FILE* status = fopen("/proc/self/status", "r");
+    if (!status) {
+        return 0;
+    }
+    char line[256];
+    long value = 0;
+    size_t length = strlen(field);
+    while (fgets(line, sizeof(line), status)) {
+        if (strncmp(line, field, length) == 0 && line[length] == ':') {
+            value = atol(line + length + 1);
+            break;
+        }
+    }
+    fclose(status);
+    return value;
+}
+
+// Reset VmHWM so the peak covers the replay only (Linux 4.0+, ignored elsewhere)
+static void resetPeakRss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) != 1) {
+            fprintf(stderr, "could not reset peak RSS, it includes trace loading\n");
+        }
+        close(fd);
+    }
+}
+
+static void touch(char* ptr, size_t size) {
+    for (size_t offset = 0; ptr && offset < size; offset += TOUCH_STRIDE) {
+        ptr[offset] = 1;
+    }
+}
+
+static void* replayThread(void* arg) {
+    ReplayThread* thread = arg;
+    Allocator* allocator = thread->allocator;
+    void** objects = thread->objects;
+
+    for (size_t n = 0; n < thread->count; n++) {
+        uint32_t index = thread->order[n];
+        ReplayOp* op = &thread->ops[index];
+        if (op->wait >= 0) {
+            while (!__atomic_load_n(&thread->done[op->wait], __ATOMIC_ACQUIRE)) {
+                sched_yield();
+            }
+        }
+
+        char* ptr;
+        switch (op->op) {
+        case TRACE_MALLOC:
+            ptr = allocator->Allocate(op->size);
+            touch(ptr, op->size);
+            objects[op->object] = ptr;
+            break;
+        case TRACE_CALLOC:
+            // The allocator's own calloc, so fresh pages that are already zero are not cleared
+            ptr = allocator->AllocateZeroed(1, op->size);
+            objects[op->object] = ptr;
+            break;
+        case TRACE_ALIGNED:
+            ptr = allocator->AllocateAligned(op->alignment, op->size);
+            touch(ptr, op->size);
+            objects[op->object] = ptr;
+            break;
+        case TRACE_REALLOC:
+            ptr = allocator->Reallocate(op->input == NO_OBJECT ? NULL : objects[op->input], op->size);
+            if (op->input != NO_OBJECT) {
+                objects[op->input] = NULL;
+            }
+            touch(ptr, op->size);
+            objects[op->object] = ptr;
+            break;
+        case TRACE_FREE:
+            allocator->Free(objects[op->object]);
+            objects[op->object] = NULL;
+            break;
+        }
+        __atomic_store_n(&thread->done[index], 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <system|lymalloc|jemalloc|tcmalloc|1|2> <trace>\n", argv[0]);
+        return 1;
+    }
+    const char* name = strcmp(argv[1], "1") == 0 ? "system" : strcmp(argv[1], "2") == 0 ? "lymalloc" : argv[1];
+    Allocator* allocator = findAllocator(name);
+    if (!allocator) {
+        fprintf(stderr, "allocator %s is not available\n", name);
+        return 1;
+    }
+
+    int fd = open(argv[2], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < TRACE_HEADER_SIZE) {
+        fprintf(stderr, "cannot read trace %s\n", argv[2]);
+        return 1;
+    }
+    char* file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    const TraceHeader* header = (const TraceHeader*)file;
+    if (file == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->recordSize != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s is not a trace file\n", argv[2]);
+        return 1;
+    }
+    size_t count = header->records;
+    if (TRACE_HEADER_SIZE + count * sizeof(TraceRecord) > (size_t)st.st_size) {
+        count = (st.st_size - TRACE_HEADER_SIZE) / sizeof(TraceRecord);
+    }
+    const TraceRecord* records = (const TraceRecord*)(file + TRACE_HEADER_SIZE);
+
+    // Resolve addresses to slots and dependencies, and track the peak of live bytes
+    ReplayOp* ops = calloc(count ? count : 1, sizeof(ReplayOp));
+    int64_t* producer = malloc((count ? count : 1) * sizeof(int64_t));  // Per slot: operation that created it
+    uint32_t* owner = malloc((count ? count : 1) * sizeof(uint32_t));  // Per slot: thread of that operation
+    size_t* objectSize = malloc((count ? count : 1) * sizeof(size_t));
+    AddressMap map;
+    map.mask = 1;
+    while (map.mask < 2 * count) {
+        map.mask <<= 1;
+    }
+    map.keys = calloc(map.mask, sizeof(uint64_t));
+    map.values = malloc(map.mask * sizeof(uint32_t));
+    map.mask--;
+
+    uint32_t objects = 0, threads = 0;
+    size_t live = 0, peakLive = 0, unmatched = 0;
+    for (size_t i = 0; i < count; i++) {
+        const TraceRecord* record = &records[i];
+        ReplayOp* op = &ops[i];
+        op->op = record->op;
+        op->wait = -1;
+        op->input = NO_OBJECT;
+        if (record->thread > threads) {
+            threads = record->thread;
+        }
+
+        if (record->op == TRACE_FREE || (record->op == TRACE_REALLOC && record->previous)) {
+            uint64_t address = record->op == TRACE_FREE ? record->object : record->previous;
+            uint32_t object = addressGet(&map, address);
+            if (object == NO_OBJECT) {
+                unmatched++;  // Allocated before recording started
+                op->op = record->op == TRACE_FREE ? TRACE_NONE : TRACE_MALLOC;
+            }
+            else {
+                addressRemove(&map, address);
+                live -= objectSize[object];
+                if (owner[object] != record->thread) {
+                    op->wait = producer[object];
+                }
+                if (record->op == TRACE_FREE) {
+                    op->object = object;
+                }
+                else {
+                    op->input = object;
+                }
+            }
+        }
+
+        if (op->op == TRACE_MALLOC || op->op == TRACE_CALLOC || op->op == TRACE_ALIGNED || op->op == TRACE_REALLOC) {
+            // A live slot at the same address was freed by a race the trace could not order; it
+            // stays allocated in the replay until the end
+            addressPut(&map, record->object, objects);
+            producer[objects] = i;
+            owner[objects] = record->thread;
+            objectSize[objects] = record->size;
+            op->object = objects++;
+            op->size = record->size;
+            op->alignment = (size_t)1 << record->alignShift;
+            live += record->size;
+            if (live > peakLive) {
+                peakLive = live;
+            }
+        }
+        else if (op->op != TRACE_FREE) {
+            op->op = TRACE_NONE;
+        }
+    }
+
+    // Split the operations per recorded thread, keeping trace order
+    size_t* start = calloc(threads + 2, sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].op != TRACE_NONE) {
+            start[records[i].thread + 1]++;
+        }
+    }
+    for (uint32_t t = 1; t <= threads + 1; t++) {
+        start[t] += start[t - 1];
+    }
+    uint32_t* order = malloc((count ? count : 1) * sizeof(uint32_t));
+    size_t* fill = calloc(threads + 1, sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].op != TRACE_NONE) {
+            uint32_t t = records[i].thread;
+            order[start[t] + fill[t]++] = (uint32_t)i;
+        }
+    }
+
+    free(map.keys);
+    free(map.values);
+    free(producer);
+    free(owner);
+    free(objectSize);
+
+    void** slots = calloc(objects ? objects : 1, sizeof(void*));
+    uint8_t* done = calloc(count ? count : 1, 1);
+    ReplayThread* workers = calloc(threads + 1, sizeof(ReplayThread));
+    pthread_t* ids = calloc(threads + 1, sizeof(pthread_t));
+
+    long baseRss = statusKb("VmRSS");
+    resetPeakRss();
+    double start_time = omp_get_wtime();
+    for (uint32_t t = 0; t <= threads; t++) {
+        workers[t] = (ReplayThread){ allocator, ops, order + start[t], start[t + 1] - start[t], slots, done };
+        pthread_create(&ids[t], NULL, replayThread, &workers[t]);
+    }
+    for (uint32_t t = 0; t <= threads; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    double end_time = omp_get_wtime();
+    long peakRss = statusKb("VmHWM");
+
+    // Objects the program never freed
+    for (uint32_t i = 0; i < objects; i++) {
+        allocator->Free(slots[i]);
+    }
+
+    double usedMb = (peakRss - baseRss) / 1024.0;
+    double fragmentation = usedMb > 0 ? 1.0 - peakLive / (usedMb * 1024 * 1024) : 0;
+    printf("%s : Time: %f seconds\n", allocator->name, end_time - start_time);
+    printf("%s : %zu operations on %u threads, %zu unmatched\n", allocator->name, start[threads + 1], threads, unmatched);
+    printf("%s : peak RSS %.1f MB over a %.1f MB baseline, peak live %.1f MB, fragmentation %.3f\n",
+           allocator->name, usedMb, baseRss / 1024.0, peakLive / (1024.0 * 1024.0), fragmentation > 0 ? fragmentation : 0);
+    if (header->dropped) {
+        printf("%s : %llu operations were dropped while recording\n", allocator->name, (unsigned long long)header->dropped);
+    }
+
+    free(workers);
+    free(ids);
+    free(done);
+    free(slots);
+    free(order);
+    free(fill);
+    free(start);
+    free(ops);
+    munmap(file, st.st_size);
+    return 0;
+}